@@ -0,0 +1,364 @@
+/*
+ * Batch jobs: manifest of operations, with a journal for restart.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "radio.h"
+#include "util.h"
+
+//
+// Journal is synced after this number of records, or this time.
+//
+#define SYNC_ITEMS      64
+#define SYNC_SECONDS    1
+
+//
+// Completed items from the journal: line number and hash of the line.
+//
+typedef struct {
+    int line;
+    unsigned long long hash;
+} done_t;
+
+static done_t *done;
+static int ndone;
+
+static int compare_done(const void *a, const void *b)
+{
+    const done_t *x = a, *y = b;
+
+    if (x->line != y->line)
+        return x->line - y->line;
+    return (x->hash < y->hash) ? -1 : (x->hash > y->hash);
+}
+
+static int is_done(int line, unsigned long long hash)
+{
+    done_t key = { line, hash };
+
+    return ndone > 0 &&
+        bsearch(&key, done, ndone, sizeof(done_t), compare_done) != 0;
+}
+
+//
+// Read the journal from previous runs.
+// An incomplete last record is ignored.
+//
+static void read_journal(const char *filename)
+{
+    FILE *fd = fopen(filename, "r");
+    char line[256], status[16];
+    unsigned long long hash;
+    int n;
+
+    if (! fd)
+        return;
+    while (fgets(line, sizeof(line), fd)) {
+        if (sscanf(line, "%15s %d %llx", status, &n, &hash) != 3 ||
+            ! strchr(line, '\n') || strcmp(status, "ok") != 0)
+            continue;
+        done = realloc(done, (ndone + 1) * sizeof(done_t));
+        if (! done) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+        done[ndone].line = n;
+        done[ndone].hash = hash;
+        ndone++;
+    }
+    fclose(fd);
+    qsort(done, ndone, sizeof(done_t), compare_done);
+}
+
+//
+// Perform one item of the manifest.
+// Called in a child process: any error terminates it.
+//  apply file.img file.conf output.img - apply configuration to image
+//  render file.img output.conf         - print configuration of image
+//  check file.img                      - verify that the image is readable
+//
+static void run_item(int argc, char **argv)
+{
+    if (strcmp(argv[0], "apply") == 0 && argc == 4) {
+        radio_read_image(argv[1]);
+        radio_parse_config(argv[2]);
+        radio_save_image(argv[3]);
+
+    } else if (strcmp(argv[0], "render") == 0 && argc == 3) {
+        FILE *conf;
+
+        radio_read_image(argv[1]);
+        conf = file_create(argv[2]);
+        radio_print_version(conf);
+        radio_print_config(conf, 1);
+        file_commit(conf);
+
+    } else if (strcmp(argv[0], "check") == 0 && argc == 2) {
+        FILE *null = fopen("/dev/null", "w");
+
+        radio_read_image(argv[1]);
+        if (null) {
+            radio_print_config(null, 1);
+            fclose(null);
+        }
+    } else {
+        fprintf(stderr, "Unknown operation or wrong number of arguments.\n");
+        exit(-1);
+    }
+}
+
+//
+// Run item in a child process.
+// Messages are collected, and printed only on failure.
+// Output files are passed to the parent, and committed
+// with the next flush of the journal.
+// Return 1 on success.
+//
+static int run_isolated(int argc, char **argv, int line_num)
+{
+    char msg[4096];
+    int fd[2], files[2], len = 0, n, status;
+    pid_t pid;
+
+    if (pipe(fd) < 0 || pipe(files) < 0) {
+        perror("pipe");
+        exit(-1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        close(fd[0]);
+        close(files[0]);
+        dup2(fd[1], 1);
+        dup2(fd[1], 2);
+        close(fd[1]);
+        file_handover(files[1]);
+        run_item(argc, argv);
+        exit(0);
+    }
+    close(fd[1]);
+    close(files[1]);
+    for (;;) {
+        char buf[256];
+
+        n = read(fd[0], buf, sizeof(buf));
+        if (n <= 0)
+            break;
+
+        // Keep the start of messages.
+        if (n > sizeof(msg) - 1 - len)
+            n = sizeof(msg) - 1 - len;
+        memcpy(msg + len, buf, n);
+        len += n;
+    }
+    close(fd[0]);
+    msg[len] = 0;
+    file_adopt(files[0]);
+    close(files[0]);
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        exit(-1);
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return 1;
+
+    fprintf(stderr, "Line %d: %s failed:\n%s", line_num, argv[0], msg);
+    if (len > 0 && msg[len-1] != '\n')
+        fprintf(stderr, "\n");
+    return 0;
+}
+
+//
+// Read manifest file into memory.
+//
+static char *read_manifest(const char *filename)
+{
+    FILE *fd = fopen(filename, "r");
+    char *data = 0;
+    int len = 0, n;
+
+    if (! fd) {
+        perror(filename);
+        exit(-1);
+    }
+    for (;;) {
+        data = realloc(data, len + 4096 + 1);
+        if (! data) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+        n = fread(data + len, 1, 4096, fd);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    fclose(fd);
+    data[len] = 0;
+    return data;
+}
+
+//
+// Records of the journal, waiting for the next flush.
+//
+static char *records;
+static int records_len;
+
+static void add_record(const char *status, int line_num, unsigned long long hash)
+{
+    records = realloc(records, records_len + 64);
+    if (! records) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    records_len += sprintf(records + records_len, "%s %d %016llx\n",
+        status, line_num, hash);
+}
+
+//
+// Make output files of completed items durable, with one fsync
+// per file and per directory, then append their records
+// to the journal and sync it.  An item is never recorded as done
+// before its output is on disk.
+//
+static void flush_journal(FILE *journal)
+{
+    file_batch_commit();
+    if (records_len > 0) {
+        fwrite(records, 1, records_len, journal);
+        records_len = 0;
+    }
+    fflush(journal);
+    fsync(fileno(journal));
+    file_batch_begin();
+}
+
+//
+// Run the batch job from a manifest file.
+// Completed items are recorded in the journal 'manifest.journal',
+// and skipped when the job is restarted.  Failed items do not stop
+// the job; they are listed at the end, and retried on restart.
+//
+void radio_batch(const char *manifest)
+{
+    char journal_name[1024], line[1024], copy[1024], *argv[8];
+    char *data, *next;
+    int argc, line_num = 0, nok = 0, nskip = 0, nfail = 0, unsynced = 0;
+    int *failed = 0;
+    long long last_sync = clock_usec();
+    FILE *journal;
+
+    // Read the whole manifest: children must not share an input stream.
+    data = read_manifest(manifest);
+    snprintf(journal_name, sizeof(journal_name), "%s.journal", manifest);
+    read_journal(journal_name);
+    journal = fopen(journal_name, "a");
+    if (! journal) {
+        perror(journal_name);
+        exit(-1);
+    }
+    file_batch_begin();
+
+    for (next = data; *next; ) {
+        unsigned long long hash;
+        char *p;
+
+        // Get next line.
+        p = strchr(next, '\n');
+        if (p)
+            *p++ = 0;
+        else
+            p = next + strlen(next);
+        snprintf(line, sizeof(line), "%s", next);
+        next = p;
+
+        line_num++;
+        p = strchr(line, '#');
+        if (p)
+            *p = 0;
+        strcpy(copy, line);
+        argc = 0;
+        for (p = strtok(copy, " \t\r\n"); p && argc < 8; p = strtok(0, " \t\r\n"))
+            argv[argc++] = p;
+        if (argc == 0)
+            continue;
+
+        // Item is identified by line number and contents.
+        hash = hash_bytes(line, strlen(line), 0);
+        if (is_done(line_num, hash)) {
+            nskip++;
+            continue;
+        }
+
+        if (run_isolated(argc, argv, line_num)) {
+            add_record("ok", line_num, hash);
+            nok++;
+        } else {
+            add_record("fail", line_num, hash);
+            failed = realloc(failed, (nfail + 1) * sizeof(int));
+            if (! failed) {
+                fprintf(stderr, "Out of memory!\n");
+                exit(-1);
+            }
+            failed[nfail++] = line_num;
+        }
+
+        // Sync outputs and the journal in batches.
+        if (++unsynced >= SYNC_ITEMS ||
+            clock_usec() - last_sync >= SYNC_SECONDS * 1000000LL) {
+            flush_journal(journal);
+            unsynced = 0;
+            last_sync = clock_usec();
+        }
+    }
+    free(data);
+    flush_journal(journal);
+    file_batch_commit();
+    fclose(journal);
+    free(records);
+
+    fprintf(stderr, "Batch %s: %d done, %d skipped, %d failed.\n",
+        manifest, nok, nskip, nfail);
+    if (nfail > 0) {
+        int i;
+
+        fprintf(stderr, "Failed lines:");
+        for (i=0; i<nfail; i++)
+            fprintf(stderr, " %d", failed[i]);
+        fprintf(stderr, "\n");
+        exit(-1);
+    }
+    free(failed);
+    free(done);
+}
@@ -0,0 +1,341 @@
+/*
+ * Bundles of radio configurations, built in parallel.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "radio.h"
+#include "util.h"
+
+//
+// Section of the bundle: a configuration of one radio.
+//
+typedef struct {
+    char name[64];                      // Name of output image
+    const char *image;                  // Base image
+    int start, end;                     // Offsets of the text
+} section_t;
+
+//
+// Running child process.
+//
+typedef struct {
+    pid_t pid;
+    int section;
+    FILE *log;                          // Messages of the child
+    FILE *files;                        // Files written by the child
+} job_t;
+
+//
+// Read the whole file into memory.
+//
+static char *read_bundle(const char *filename, int *nbytes)
+{
+    FILE *fd = fopen(filename, "r");
+    char *data;
+    long len;
+
+    if (! fd) {
+        perror(filename);
+        exit(-1);
+    }
+    fseek(fd, 0, SEEK_END);
+    len = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+    data = malloc(len + 1);
+    if (! data) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    if (len > 0 && fread(data, 1, len, fd) != len) {
+        perror(filename);
+        exit(-1);
+    }
+    fclose(fd);
+    data[len] = 0;
+    *nbytes = len;
+    return data;
+}
+
+//
+// Get the value of parameter, when the line starts with the name.
+// The value is terminated in place.
+//
+static char *get_value(char *line, const char *name)
+{
+    int len = strlen(name);
+    char *v, *eol;
+
+    if (strncasecmp(line, name, len) != 0)
+        return 0;
+    v = line + len;
+    v += strspn(v, " \t");
+    eol = v + strcspn(v, "#\r\n");
+    while (eol > v && (eol[-1] == ' ' || eol[-1] == '\t'))
+        eol--;
+    if (eol == v)
+        return 0;
+    *eol = 0;
+    return v;
+}
+
+//
+// Path of the file named in the bundle, relative to the bundle.
+//
+static char *bundle_path(const char *bundle, const char *name)
+{
+    const char *slash = strrchr(bundle, '/');
+    char *path;
+
+    if (name[0] == '/' || ! slash)
+        return strdup(name);
+    path = malloc(slash - bundle + 1 + strlen(name) + 1);
+    if (! path) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    sprintf(path, "%.*s/%s", (int) (slash - bundle), bundle, name);
+    return path;
+}
+
+//
+// Index the bundle: find sections by a scan of line starts.
+// The text of sections is left intact; names and images
+// are copied.  Return the number of sections.
+//
+static int index_bundle(const char *filename, const char *data, int nbytes,
+    section_t **result)
+{
+    section_t *sect = 0;
+    const char *line, *eol, *image = 0;
+    char copy[256], *v;
+    int nsect = 0, len;
+
+    for (line=data; line < data + nbytes; line=eol) {
+        eol = memchr(line, '\n', data + nbytes - line);
+        eol = eol ? eol+1 : data + nbytes;
+        if (*line != 'S' && *line != 's' && *line != 'I' && *line != 'i')
+            continue;
+
+        len = eol - line;
+        if (len > sizeof(copy) - 1)
+            len = sizeof(copy) - 1;
+        memcpy(copy, line, len);
+        copy[len] = 0;
+
+        if ((v = get_value(copy, "Section:")) != 0) {
+            if (strchr(v, '/') || strlen(v) >= sizeof(sect->name)) {
+                fprintf(stderr, "%s: Bad section name '%s'.\n", filename, v);
+                exit(-1);
+            }
+            if (nsect > 0)
+                sect[nsect-1].end = line - data;
+            if (nsect % 256 == 0) {
+                sect = realloc(sect, (nsect + 256) * sizeof(section_t));
+                if (! sect) {
+                    fprintf(stderr, "Out of memory!\n");
+                    exit(-1);
+                }
+            }
+            strcpy(sect[nsect].name, v);
+            sect[nsect].image = image;
+            sect[nsect].start = eol - data;
+            sect[nsect].end = nbytes;
+            nsect++;
+
+        } else if ((v = get_value(copy, "Image:")) != 0) {
+            // Before the first section: default image for all.
+            if (nsect > 0)
+                sect[nsect-1].image = bundle_path(filename, v);
+            else
+                image = bundle_path(filename, v);
+        }
+    }
+    *result = sect;
+    return nsect;
+}
+
+//
+// Build the image of one section.
+// Called in a child process: any error terminates it.
+//
+static void run_section(const char *filename, const char *data,
+    const section_t *s, const char *outdir)
+{
+    char label[1100], path[1100], *text, *line;
+    int len = s->end - s->start;
+
+    if (! s->image) {
+        fprintf(stderr, "No base image.\n");
+        exit(-1);
+    }
+    radio_read_image((char*) s->image);
+
+    // Image is not a parameter of the radio: comment it out.
+    text = malloc(len + 1);
+    if (! text) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    memcpy(text, data + s->start, len);
+    text[len] = 0;
+    for (line=text; line; line=strchr(line, '\n')) {
+        if (*line == '\n')
+            line++;
+        if (strncasecmp(line, "Image:", 6) == 0)
+            *line = '#';
+    }
+
+    // Includes are relative to the bundle.
+    snprintf(label, sizeof(label), "%s:%s", filename, s->name);
+    radio_parse_text(label, text);
+
+    snprintf(path, sizeof(path), "%s/%s.img", outdir ? outdir : ".", s->name);
+    radio_save_image(path);
+}
+
+//
+// Start a child process for the section.
+// Messages go to a temporary file, printed only on failure.
+// Written images are passed to the parent, to be committed together.
+//
+static void start_job(job_t *job, int n, const char *filename, const char *data,
+    const section_t *s, const char *outdir)
+{
+    job->section = n;
+    job->log = tmpfile();
+    job->files = tmpfile();
+    if (! job->log || ! job->files) {
+        perror("tmpfile");
+        exit(-1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    job->pid = fork();
+    if (job->pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (job->pid == 0) {
+        dup2(fileno(job->log), 1);
+        dup2(fileno(job->log), 2);
+        file_handover(fileno(job->files));
+        run_section(filename, data, s, outdir);
+        exit(0);
+    }
+}
+
+//
+// Build images of all sections of the bundle, in parallel.
+// The bundle is read once and indexed by offsets of sections;
+// every section is applied to its base image in a separate
+// process, at most njobs at a time.  Images are made durable
+// together, once per njobs finished sections.
+//
+void radio_bundle(const char *filename, const char *outdir, int njobs)
+{
+    section_t *sect;
+    job_t *job;
+    char *data;
+    int nbytes, nsect, next = 0, nrunning = 0, nok = 0, nfail = 0;
+    int ndone = 0, status, i, c;
+    pid_t pid;
+
+    data = read_bundle(filename, &nbytes);
+    nsect = index_bundle(filename, data, nbytes, &sect);
+    if (nsect == 0) {
+        fprintf(stderr, "%s: No sections.\n", filename);
+        exit(-1);
+    }
+    if (njobs < 1)
+        njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (njobs < 1)
+        njobs = 1;
+    if (njobs > nsect)
+        njobs = nsect;
+    job = calloc(njobs, sizeof(job_t));
+    if (! job) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+
+    file_batch_begin();
+    while (next < nsect || nrunning > 0) {
+        // Fill idle slots.
+        for (i=0; i<njobs && next < nsect; i++) {
+            if (job[i].pid == 0) {
+                start_job(&job[i], next, filename, data, &sect[next], outdir);
+                next++;
+                nrunning++;
+            }
+        }
+
+        pid = wait(&status);
+        if (pid < 0) {
+            perror("wait");
+            exit(-1);
+        }
+        for (i=0; i<njobs; i++)
+            if (job[i].pid == pid)
+                break;
+        if (i == njobs)
+            continue;
+        nrunning--;
+        job[i].pid = 0;
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            nok++;
+        } else {
+            fprintf(stderr, "Section %s failed:\n", sect[job[i].section].name);
+            rewind(job[i].log);
+            while ((c = getc(job[i].log)) != EOF)
+                putc(c, stderr);
+            nfail++;
+        }
+        fclose(job[i].log);
+
+        // Take the images of the child.
+        lseek(fileno(job[i].files), 0, SEEK_SET);
+        file_adopt(fileno(job[i].files));
+        fclose(job[i].files);
+        if (++ndone % njobs == 0) {
+            file_batch_commit();
+            file_batch_begin();
+        }
+    }
+    file_batch_commit();
+
+    fprintf(stderr, "Bundle %s: %d sections, %d images written, %d failed.\n",
+        filename, nsect, nok, nfail);
+    if (nfail > 0)
+        exit(-1);
+    free(job);
+    free(sect);
+    free(data);
+}
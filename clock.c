@@ -0,0 +1,281 @@
+/*
+ * Clock of the program: real time, or virtual time for simulation.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef MINGW32
+#   include <windows.h>
+#else
+#   include <pthread.h>
+#   include <poll.h>
+#   include <sys/select.h>
+#endif
+#include "util.h"
+
+//
+// Virtual time moves only when every thread taking part is waiting
+// in the clock: then it jumps to the nearest deadline, unless one of
+// the waiters has input pending.  Sessions against stand-ins
+// in the same process run without real delays.
+//
+#ifndef MINGW32
+typedef struct waiter {
+    struct waiter *next;
+    long long deadline;                 // Virtual time to wake up
+    int fd;                             // Input to wait for, or -1
+    int waiting;                        // Not satisfied yet
+} waiter_t;
+
+static int virtual_mode;                // Virtual time enabled
+static long long virtual_now;           // Current virtual time, usec
+static int nparties;                    // Threads taking part
+static int nwaiting;                    // Threads waiting in the clock
+static waiter_t *waiters;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+#endif
+
+//
+// Get real time in microseconds.
+//
+static long long real_usec()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+#ifndef MINGW32
+//
+// Check for input without waiting.
+//
+static int input_ready(int fd)
+{
+    struct pollfd p;
+
+    p.fd = fd;
+    p.events = POLLIN;
+    return poll(&p, 1, 0) == 1;
+}
+
+//
+// All threads are waiting: wake up the one with input pending,
+// or move the time to the nearest deadline.  Called with lock held.
+//
+static void advance()
+{
+    waiter_t *w;
+    long long next = -1;
+
+    for (w=waiters; w; w=w->next) {
+        if (w->waiting && w->fd >= 0 && input_ready(w->fd)) {
+            w->waiting = 0;
+            nwaiting--;
+            pthread_cond_broadcast(&wakeup);
+            return;
+        }
+    }
+    for (w=waiters; w; w=w->next) {
+        if (w->waiting && (next < 0 || w->deadline < next))
+            next = w->deadline;
+    }
+    if (next > virtual_now)
+        virtual_now = next;
+    for (w=waiters; w; w=w->next) {
+        if (w->waiting && w->deadline <= virtual_now) {
+            w->waiting = 0;
+            nwaiting--;
+        }
+    }
+    pthread_cond_broadcast(&wakeup);
+}
+
+//
+// Wait in virtual time until the deadline, or for input on fd.
+// Return 1 when input is ready.
+//
+static int virtual_wait(long long usec, int fd)
+{
+    waiter_t w, **p;
+
+    pthread_mutex_lock(&lock);
+    w.deadline = virtual_now + usec;
+    w.fd = fd;
+    w.waiting = 1;
+    w.next = waiters;
+    waiters = &w;
+    nwaiting++;
+    while (w.waiting) {
+        if (nwaiting >= nparties)
+            advance();
+        if (w.waiting)
+            pthread_cond_wait(&wakeup, &lock);
+    }
+    for (p=&waiters; *p != &w; p=&(*p)->next)
+        continue;
+    *p = w.next;
+    pthread_mutex_unlock(&lock);
+    return fd >= 0 && input_ready(fd);
+}
+#endif
+
+//
+// Switch to virtual time, starting from the current real time.
+// The calling thread takes part.
+//
+void clock_virtual()
+{
+#ifdef MINGW32
+    fprintf(stderr, "Virtual time is not supported.\n");
+    exit(-1);
+#else
+    virtual_now = real_usec();
+    virtual_mode = 1;
+    nparties = 1;
+#endif
+}
+
+//
+// Add a thread to virtual time.  Called by the creator of the thread,
+// so the time does not run ahead before the thread starts.
+//
+void clock_attach()
+{
+#ifndef MINGW32
+    pthread_mutex_lock(&lock);
+    nparties++;
+    pthread_mutex_unlock(&lock);
+#endif
+}
+
+//
+// Remove the calling thread from virtual time, when it finishes.
+//
+void clock_detach()
+{
+#ifndef MINGW32
+    pthread_mutex_lock(&lock);
+    nparties--;
+    if (virtual_mode && nparties > 0 && nwaiting >= nparties)
+        advance();
+    pthread_mutex_unlock(&lock);
+#endif
+}
+
+//
+// Get current time in microseconds.
+//
+long long clock_usec()
+{
+#ifndef MINGW32
+    if (virtual_mode) {
+        long long now;
+
+        pthread_mutex_lock(&lock);
+        now = virtual_now;
+        pthread_mutex_unlock(&lock);
+        return now;
+    }
+#endif
+    return real_usec();
+}
+
+//
+// Sleep for the given time in microseconds.
+//
+void clock_sleep(long long usec)
+{
+#ifdef MINGW32
+    Sleep(usec / 1000);
+#else
+    if (virtual_mode) {
+        virtual_wait(usec, -1);
+        return;
+    }
+    usleep(usec);
+#endif
+}
+
+//
+// Wait for input on the file descriptor, up to the given time in microseconds.
+// Return 1 when input is ready, 0 on timeout.
+//
+int clock_wait_input(int fd, long long usec)
+{
+#ifdef MINGW32
+    return 1;
+#else
+    fd_set rset;
+    struct timeval timo;
+
+    if (virtual_mode)
+        return input_ready(fd) || virtual_wait(usec, fd);
+
+    FD_ZERO(&rset);
+    FD_SET(fd, &rset);
+    timo.tv_sec = usec / 1000000;
+    timo.tv_usec = usec % 1000000;
+    return select(fd + 1, &rset, 0, 0, &timo) == 1;
+#endif
+}
+
+//
+// Is the clock virtual?
+//
+int clock_is_virtual()
+{
+#ifdef MINGW32
+    return 0;
+#else
+    return virtual_mode;
+#endif
+}
+
+//
+// In virtual time: is any thread waiting for input on the file
+// descriptor, with a timeout?  Polls without a timeout do not count.
+//
+int clock_input_wanted(int fd)
+{
+#ifdef MINGW32
+    return 0;
+#else
+    waiter_t *w;
+    int wanted = 0;
+
+    pthread_mutex_lock(&lock);
+    for (w=waiters; w; w=w->next) {
+        if (w->waiting && w->fd == fd && w->deadline > virtual_now)
+            wanted = 1;
+    }
+    pthread_mutex_unlock(&lock);
+    return wanted;
+#endif
+}
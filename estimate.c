@@ -0,0 +1,267 @@
+/*
+ * Estimation of session times, and capacity planning for a station.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "radio.h"
+#include "util.h"
+
+//
+// Operations of a session.
+//
+enum {
+    OP_READ,                            // Download image
+    OP_WRITE,                           // Upload image
+    OP_CONFIG,                          // Download, then upload
+    NOPS,
+};
+
+static const char *OP_NAME[NOPS] = { "read", "write", "config" };
+
+static const char *TYPE_NAME[] = { "ft60", "vx2" };
+#define NTYPES  2
+
+//
+// Default time for the other side to reply, in msec.
+// Typical for a USB serial adapter with a low latency timer.
+//
+#define TURNAROUND_MSEC 2.0
+
+//
+// Estimated session time, by components, in seconds.
+//
+typedef struct {
+    double wire;                        // Bytes on the wire
+    double handshake;                   // Waits for replies
+    double pause;                       // Pacing delays
+    double reset;                       // Reset of the radio after session
+    double measured;                    // Mean of measured times, or 0
+    int nmeasured;
+} estimate_t;
+
+static estimate_t table[NTYPES][NOPS];
+static double turnaround_msec = TURNAROUND_MSEC;
+
+static int find_name(const char **names, int n, const char *name)
+{
+    int i;
+
+    for (i=0; i<n; i++)
+        if (strcasecmp(names[i], name) == 0)
+            return i;
+    return -1;
+}
+
+//
+// Add one transfer to the estimate.
+//
+static void add_transfer(estimate_t *e, radio_device_t *dev, int upload)
+{
+    radio_wire_t w;
+
+    dev->wire(upload, &w);
+
+    // Start bit, 8 data bits, stop bit.
+    e->wire += w.bytes * 10.0 / dev->baud;
+    e->handshake += w.handshakes * turnaround_msec / 1000.0;
+    e->pause += w.pause_usec / 1000000.0;
+}
+
+//
+// Read measured timing data.
+// Format of lines:
+//      turnaround msec         - time for the other side to reply
+//      type operation seconds  - measured session time
+//
+static void read_timing(const char *filename)
+{
+    FILE *fd = fopen(filename, "r");
+    char line[256], type[32], op[32];
+    double value;
+    int t, o;
+
+    if (! fd) {
+        perror(filename);
+        exit(-1);
+    }
+    while (fgets(line, sizeof(line), fd)) {
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0)
+            continue;
+        if (sscanf(line, "turnaround %lf", &value) == 1) {
+            turnaround_msec = value;
+            continue;
+        }
+        if (sscanf(line, "%31s %31s %lf", type, op, &value) != 3)
+            goto bad;
+        t = find_name(TYPE_NAME, NTYPES, type);
+        o = find_name(OP_NAME, NOPS, op);
+        if (t < 0 || o < 0 || value <= 0) {
+bad:        fprintf(stderr, "%s: Invalid line: '%s'\n", filename, line);
+            exit(-1);
+        }
+        table[t][o].measured += value;
+        table[t][o].nmeasured++;
+    }
+    fclose(fd);
+}
+
+//
+// Expected time of a session, in seconds.
+// Measured data has a priority.
+//
+static double session_time(estimate_t *e)
+{
+    if (e->nmeasured > 0)
+        return e->measured / e->nmeasured;
+    return e->wire + e->handshake + e->pause + e->reset;
+}
+
+static int compare_time(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x < y) ? 1 : (x > y) ? -1 : 0;
+}
+
+//
+// Estimate session times, and simulate the list of jobs on the station.
+// Job is type:operation[:count], for example ft60:write:20.
+//
+void radio_estimate(int nports, const char *timing_file, int njobs, char **jobs)
+{
+    double *session, *busy, total = 0, makespan = 0, bound;
+    int *count, nsessions = 0, i, t, o, p;
+
+    if (nports < 1) {
+        fprintf(stderr, "Invalid number of ports: %d\n", nports);
+        exit(-1);
+    }
+    if (timing_file)
+        read_timing(timing_file);
+
+    // Parse the list of jobs.
+    count = calloc(njobs + 1, sizeof(int));
+    if (! count) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    for (i=0; i<njobs; i++) {
+        char type[32], op[32];
+
+        count[i] = 1;
+        if (sscanf(jobs[i], "%31[^:]:%31[^:]:%d", type, op, &count[i]) < 2 ||
+            (t = find_name(TYPE_NAME, NTYPES, type)) < 0 ||
+            (o = find_name(OP_NAME, NOPS, op)) < 0 || count[i] < 0) {
+            fprintf(stderr, "Invalid job: %s\n", jobs[i]);
+            exit(-1);
+        }
+        nsessions += count[i];
+    }
+
+    // Compute session times from protocol parameters.
+    for (t=0; t<NTYPES; t++) {
+        radio_device_t *dev = radio_find_type(TYPE_NAME[t]);
+
+        for (o=0; o<NOPS; o++) {
+            estimate_t *e = &table[t][o];
+
+            if (o != OP_WRITE)
+                add_transfer(e, dev, 0);
+            if (o != OP_READ)
+                add_transfer(e, dev, 1);
+            e->reset = RADIO_RESET_MSEC / 1000.0;
+        }
+    }
+
+    printf("Session time, seconds (turnaround %.1f msec):\n", turnaround_msec);
+    printf("Type  Operation   Wire Handshake  Pause  Reset  Total Measured\n");
+    for (t=0; t<NTYPES; t++) {
+        for (o=0; o<NOPS; o++) {
+            estimate_t *e = &table[t][o];
+
+            printf("%-5s %-9s %6.1f %9.1f %6.1f %6.1f %6.1f", TYPE_NAME[t],
+                OP_NAME[o], e->wire, e->handshake, e->pause, e->reset,
+                e->wire + e->handshake + e->pause + e->reset);
+            if (e->nmeasured > 0)
+                printf(" %8.1f\n", e->measured / e->nmeasured);
+            else
+                printf("        -\n");
+        }
+    }
+    if (njobs == 0)
+        return;
+    session = calloc(nsessions + 1, sizeof(double));
+    busy = calloc(nports, sizeof(double));
+    if (! session || ! busy) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    nsessions = 0;
+    for (i=0; i<njobs; i++) {
+        char type[32], op[32];
+        double time;
+        int n;
+
+        sscanf(jobs[i], "%31[^:]:%31[^:]", type, op);
+        time = session_time(&table[find_name(TYPE_NAME, NTYPES, type)]
+                                  [find_name(OP_NAME, NOPS, op)]);
+        for (n=0; n<count[i]; n++)
+            session[nsessions++] = time;
+    }
+
+    // Longest sessions first, each to the port which becomes free first.
+    qsort(session, nsessions, sizeof(double), compare_time);
+    for (i=0; i<nsessions; i++) {
+        int best = 0;
+
+        for (p=1; p<nports; p++)
+            if (busy[p] < busy[best])
+                best = p;
+        busy[best] += session[i];
+        total += session[i];
+    }
+    for (p=0; p<nports; p++)
+        if (busy[p] > makespan)
+            makespan = busy[p];
+
+    // No schedule is shorter than this.
+    bound = total / nports;
+    if (nsessions > 0 && session[0] > bound)
+        bound = session[0];
+
+    printf("\n");
+    printf("Sessions:     %d on %d ports\n", nsessions, nports);
+    printf("Total work:   %.1f sec\n", total);
+    printf("Makespan:     %.1f sec (%.1f min), lower bound %.1f sec\n",
+        makespan, makespan / 60, bound);
+    printf("Utilisation:  %.1f%%\n",
+        makespan > 0 ? 100 * total / (nports * makespan) : 0.0);
+    free(count);
+    free(session);
+    free(busy);
+}
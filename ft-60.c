@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include "radio.h"
 #include "util.h"
+#include "trace.h"
 
 #define NCHAN           1000
 #define NBANKS          10
@@ -135,35 +136,30 @@ static int read_block(int fd, int start, unsigned char *data, int nbytes)
     int len;
 
     // Read data.
+    radio_health_check();
     len = serial_read(fd, data, nbytes);
     if (len != nbytes) {
         if (start == 0)
             return 0;
-        fprintf(stderr, "Reading block 0x%04x: got only %d bytes.\n", start, len);
-        exit(-1);
+        radio_message(0, "Reading block 0x%04x: got only %d bytes.\n", start, len);
+        radio_health_event(HEALTH_TIMEOUT);
+        radio_fail();
     }
+    TRACE2(block_rx, start, nbytes);
 
     // Get acknowledge.
     serial_write(fd, "\x06", 1);
-    if (serial_read(fd, &reply, 1) != 1) {
-        fprintf(stderr, "No acknowledge after block 0x%04x.\n", start);
-        exit(-1);
+    if (radio_read_ack(fd, &reply) != 1) {
+        radio_message(0, "No acknowledge after block 0x%04x.\n", start);
+        radio_fail();
     }
     if (reply != 0x06) {
-        fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", start, reply);
-        exit(-1);
-    }
-    if (serial_verbose) {
-        printf("# Read 0x%04x: ", start);
-        print_hex(data, nbytes);
-        printf("\n");
-    } else {
-        ++radio_progress;
-        if (radio_progress % 16 == 0) {
-            fprintf(stderr, "#");
-            fflush(stderr);
-        }
+        radio_message(0, "Bad acknowledge after block 0x%04x: %02x\n", start, reply);
+        radio_fail();
     }
+    TRACE2(ack, start, reply);
+    radio_fingerprint_block(start, data, nbytes);
+    radio_block(start, 0, data, nbytes);
     return 1;
 }
 
@@ -178,34 +174,30 @@ static int write_block(int fd, int start, const unsigned char *data, int nbytes)
     int len;
 
     serial_write(fd, data, nbytes);
+    TRACE2(block_tx, start, nbytes);
 
     // Get echo.
     len = serial_read(fd, reply, nbytes);
     if (len != nbytes) {
-        fprintf(stderr, "! Echo for block 0x%04x: got only %d bytes.\n", start, len);
+        radio_message(0, "! Echo for block 0x%04x: got only %d bytes.\n", start, len);
+        radio_health_event(HEALTH_ECHO);
         return 0;
     }
+    if (memcmp(reply, data, nbytes) != 0)
+        radio_health_event(HEALTH_ECHO);
+    TRACE2(echo, start, len);
 
     // Get acknowledge.
-    if (serial_read(fd, reply, 1) != 1) {
-        fprintf(stderr, "! No acknowledge after block 0x%04x.\n", start);
+    if (radio_read_ack(fd, reply) != 1) {
+        radio_message(0, "! No acknowledge after block 0x%04x.\n", start);
         return 0;
     }
     if (reply[0] != 0x06) {
-        fprintf(stderr, "! Bad acknowledge after block 0x%04x: %02x\n", start, reply[0]);
+        radio_message(0, "! Bad acknowledge after block 0x%04x: %02x\n", start, reply[0]);
         return 0;
     }
-    if (serial_verbose) {
-        printf("# Write 0x%04x: ", start);
-        print_hex(data, nbytes);
-        printf("\n");
-    } else {
-        ++radio_progress;
-        if (radio_progress % 16 == 0) {
-            fprintf(stderr, "#");
-            fflush(stderr);
-        }
-    }
+    TRACE2(ack, start, reply[0]);
+    radio_block(start, 1, data, nbytes);
     return 1;
 }
 
@@ -217,30 +209,32 @@ static void ft60_download()
     int addr, sum;
 
     if (serial_verbose)
-        fprintf(stderr, "\nPlease follow the procedure:\n");
+        radio_message(0, "\nPlease follow the procedure:\n");
     else
-        fprintf(stderr, "please follow the procedure.\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "1. Power Off the FT60.\n");
-    fprintf(stderr, "2. Hold down the MONI switch and Power On the FT60.\n");
-    fprintf(stderr, "3. Rotate the right DIAL knob to select F8 CLONE.\n");
-    fprintf(stderr, "4. Briefly press the [F/W] key. The display should go blank then show CLONE.\n");
-    fprintf(stderr, "5. Press and hold the PTT switch until the radio starts to send.\n");
-    fprintf(stderr, "-- Or enter ^C to abort the memory read.\n");
+        radio_message(0, "please follow the procedure.\n");
+    radio_message(0, "\n");
+    radio_message(0, "1. Power Off the FT60.\n");
+    radio_message(0, "2. Hold down the MONI switch and Power On the FT60.\n");
+    radio_message(0, "3. Rotate the right DIAL knob to select F8 CLONE.\n");
+    radio_message(0, "4. Briefly press the [F/W] key. The display should go blank then show CLONE.\n");
+    radio_message(0, "5. Press and hold the PTT switch until the radio starts to send.\n");
+    radio_message(0, "-- Or enter ^C to abort the memory read.\n");
 again:
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Waiting for data... ");
-    fflush(stderr);
+    radio_message(0, "\n");
+    radio_message(0, "Waiting for data... ");
 
     // Wait for the first 8 bytes.
+    radio_timeline_phase("wait for data");
     while (read_block(radio_port, 0, &radio_mem[0], 8) == 0)
         continue;
 
     // Get the rest of data.
+    radio_timeline_phase("bulk blocks");
     for (addr=8; addr<MEMSZ; addr+=64)
         read_block(radio_port, addr, &radio_mem[addr], 64);
 
     // Get the checksum.
+    radio_timeline_phase("checksum");
     read_block(radio_port, MEMSZ, &radio_mem[MEMSZ], 1);
 
     // Verify the checksum.
@@ -248,19 +242,21 @@ again:
     for (addr=0; addr<MEMSZ; addr++)
         sum += radio_mem[addr];
     sum = sum & 0xff;
+    TRACE2(checksum, sum, radio_mem[MEMSZ]);
     if (sum != radio_mem[MEMSZ]) {
         if (serial_verbose) {
-            printf("Checksum = %02x (BAD)\n", radio_mem[MEMSZ]);
-            fprintf(stderr, "BAD CHECKSUM!\n");
+            radio_message(1, "Checksum = %02x (BAD)\n", radio_mem[MEMSZ]);
+            radio_message(0, "BAD CHECKSUM!\n");
         } else
-            fprintf(stderr, "[BAD CHECKSUM]\n");
-        fprintf(stderr, "Please, repeat the procedure:\n");
-        fprintf(stderr, "Press and hold the PTT switch until the radio starts to send.\n");
-        fprintf(stderr, "Or enter ^C to abort the memory read.\n");
+            radio_message(0, "[BAD CHECKSUM]\n");
+        radio_message(0, "Please, repeat the procedure:\n");
+        radio_message(0, "Press and hold the PTT switch until the radio starts to send.\n");
+        radio_message(0, "Or enter ^C to abort the memory read.\n");
+        radio_health_event(HEALTH_RETRY);
         goto again;
     }
     if (serial_verbose)
-        printf("Checksum = %02x (OK)\n", radio_mem[MEMSZ]);
+        radio_message(1, "Checksum = %02x (OK)\n", radio_mem[MEMSZ]);
 }
 
 //
@@ -269,52 +265,55 @@ again:
 static void ft60_upload(int cont_flag)
 {
     int addr, sum;
-    char buf[80];
 
     if (serial_verbose)
-        fprintf(stderr, "\nPlease follow the procedure:\n");
+        radio_message(0, "\nPlease follow the procedure:\n");
     else
-        fprintf(stderr, "please follow the procedure.\n");
-    fprintf(stderr, "\n");
+        radio_message(0, "please follow the procedure.\n");
+    radio_message(0, "\n");
     if (cont_flag) {
-        fprintf(stderr, "1. Press the MONI switch until the radio starts to receive.\n");
-        fprintf(stderr, "2. Press <Enter> to continue.\n");
+        radio_message(0, "1. Press the MONI switch until the radio starts to receive.\n");
+        radio_message(0, "2. Press <Enter> to continue.\n");
     } else {
-        fprintf(stderr, "1. Power Off the FT60.\n");
-        fprintf(stderr, "2. Hold down the MONI switch and Power On the FT60.\n");
-        fprintf(stderr, "3. Rotate the right DIAL knob to select F8 CLONE.\n");
-        fprintf(stderr, "4. Briefly press the [F/W] key. The display should go blank then show CLONE.\n");
-        fprintf(stderr, "5. Press the MONI switch until the radio starts to receive.\n");
-        fprintf(stderr, "6. Press <Enter> to continue.\n");
+        radio_message(0, "1. Power Off the FT60.\n");
+        radio_message(0, "2. Hold down the MONI switch and Power On the FT60.\n");
+        radio_message(0, "3. Rotate the right DIAL knob to select F8 CLONE.\n");
+        radio_message(0, "4. Briefly press the [F/W] key. The display should go blank then show CLONE.\n");
+        radio_message(0, "5. Press the MONI switch until the radio starts to receive.\n");
+        radio_message(0, "6. Press <Enter> to continue.\n");
     }
-    fprintf(stderr, "-- Or enter ^C to abort the memory write.\n");
+    radio_message(0, "-- Or enter ^C to abort the memory write.\n");
 again:
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Press <Enter> to continue: ");
-    fflush(stderr);
+    radio_message(0, "\n");
+    radio_message(0, "Press <Enter> to continue: ");
+    radio_timeline_phase("wait for operator");
     serial_flush(radio_port);
-    if (! fgets(buf, sizeof(buf), stdin))
-	/*ignore*/;
-    fprintf(stderr, "Sending data... ");
-    fflush(stderr);
+    radio_wait_enter();
+    radio_message(0, "Sending data... ");
 
+    radio_timeline_phase("header blocks");
     if (! write_block(radio_port, 0, &radio_mem[0], 8)) {
-error:  fprintf(stderr, "\nPlease, repeat the procedure:\n");
-        fprintf(stderr, "1. Briefly press the [F/W] key to clear the ERROR status.\n");
-        fprintf(stderr, "2. Press the MONI switch until the radio starts to receive.\n");
-        fprintf(stderr, "3. Press <Enter> to continue.\n");
-        fprintf(stderr, "-- Or enter ^C to abort the memory write.\n");
+error:  radio_timeline_phase("retry");
+        radio_message(0, "\nPlease, repeat the procedure:\n");
+        radio_message(0, "1. Briefly press the [F/W] key to clear the ERROR status.\n");
+        radio_message(0, "2. Press the MONI switch until the radio starts to receive.\n");
+        radio_message(0, "3. Press <Enter> to continue.\n");
+        radio_message(0, "-- Or enter ^C to abort the memory write.\n");
+        radio_health_event(HEALTH_RETRY);
         goto again;
     }
+    radio_timeline_phase("bulk blocks");
     for (addr=8; addr<MEMSZ; addr+=64)
         if (! write_block(radio_port, addr, &radio_mem[addr], 64))
             goto error;
 
     // Compute the checksum.
+    radio_timeline_phase("checksum");
     sum = 0;
     for (addr=0; addr<MEMSZ; addr++)
         sum += radio_mem[addr];
     radio_mem[MEMSZ] = sum;
+    TRACE2(checksum, sum & 0xff, radio_mem[MEMSZ]);
 
     // Send a checksum.
     if (! write_block(radio_port, MEMSZ, &radio_mem[MEMSZ], 1))
@@ -322,111 +321,51 @@ error:  fprintf(stderr, "\nPlease, repeat the procedure:\n");
 }
 
 //
-// Check whether the memory image is compatible with this device.
+// Count traffic of download or upload, for estimation of session time.
+// Every block is acknowledged, in both directions.
+// The echo of the cable shares the wire with the data.
 //
-static int ft60_is_compatible()
+static void ft60_wire(int upload, radio_wire_t *w)
 {
-    return strncmp("AH017$", (char*)&radio_mem[0], 6) == 0;
-}
-
-//
-// Convert squelch string to CTCSS tone index.
-// Return -1 on error.
-// Format: nnn.n
-//
-static int encode_tone(char *str)
-{
-    unsigned val;
-
-    // CTCSS tone
-    float hz;
-    if (sscanf(str, "%f", &hz) != 1)
-        return -1;
-
-    // Round to integer.
-    val = hz * 10.0 + 0.5;
-    if (val < 0x0258)
-        return -1;
+    int nblocks = 1 + (MEMSZ - 8 + 63) / 64 + 1;
 
-    // Find a valid index in CTCSS table.
-    int i;
-    for (i=0; i<NCTCSS; i++)
-        if (CTCSS_TONES[i] == val)
-            return i;
-    return -1;
+    w->bytes = MEMSZ + 1 + nblocks;
+    w->handshakes = nblocks;
+    w->pause_usec = 0;
 }
 
 //
-// Convert squelch string to DCS code index.
-// Return -1 on error.
-// Format: Dnnn
+// Check whether the memory image is compatible with this device.
 //
-static int encode_dcs(char *str)
+static int ft60_is_compatible()
 {
-    unsigned val;
-
-    // DCS tone
-    if (sscanf(++str, "%u", &val) != 1)
-        return -1;
-
-    // Find a valid index in DCS table.
-    int i;
-    for (i=0; i<NDCS; i++)
-        if (DCS_CODES[i] == val)
-            return i;
-    return -1;
+    return strncmp("AH017$", (char*)&radio_mem[0], 6) == 0;
 }
 
 //
-// Convert squelch strings to tmode value, tone index and dtcs index.
-//
-static int encode_squelch(char *rx, char *tx, int *tone, int *dtcs)
-{
-    int rx_tone = -1, tx_tone = -1, rx_dcs = -1, tx_dcs = -1, rx_rev = 0;
-
-    if (*rx == 'D' || *rx == 'd') {             // Receive DCS code
-        rx_dcs = encode_dcs(rx);
-    } else if (*rx >= '0' && *rx <= '9') {      // Receive CTCSS tone
-        rx_tone = encode_tone(rx);
-    } else if (*rx == '-' && rx[1] >= '0' && rx[1] <= '9') {
-        rx_tone = encode_tone(rx+1);
-        rx_rev = 1;
-    }
-    if (*tx == 'D' || *tx == 'd') {             // Transmit DCS code
-        tx_dcs = encode_dcs(tx);
-    } else if (*tx >= '0' && *tx <= '9') {      // Transmit CTCSS tone
-        tx_tone = encode_tone(tx);
-    }
-
-    // Encode tmode.
-    *tone = TONE_DEFAULT;
-    *dtcs = 0;
-    if (rx_dcs >= 0) {
-        *dtcs = rx_dcs;
-        if (tx_tone >= 0) {
-            *tone = tx_tone;
-            return T_T_DCS;
-        }
-        return T_DTCS;
-    }
-    if (tx_dcs >= 0) {
-        *dtcs = tx_dcs;
-        if (rx_tone >= 0) {
-            *tone = rx_tone;
-            return T_D_TSQL;
-        }
-        return T_D;
-    }
-    if (tx_tone >= 0) {
-        *tone = tx_tone;
-        if (rx_tone < 0)
-            return T_TONE;
-        if (rx_rev)
-            return T_TSQL_REV;
-        return T_TSQL;
-    }
-    return T_OFF;
-}
+// Squelch modes: kinds of receive and transmit squelch for every tmode,
+// and tmode for every combination of squelch values.
+//
+static const radio_squelch_t SQUELCH = {
+    8,
+    //  OFF     TONE    TSQL    TSQL_REV DTCS   D       T_DCS   D_TSQL
+    { Q_NONE, Q_NONE, Q_CTCS, Q_CTCS, Q_DCS,  Q_NONE, Q_DCS,  Q_CTCS },   // Receive
+    { Q_NONE, Q_CTCS, Q_CTCS, Q_CTCS, Q_DCS,  Q_DCS,  Q_CTCS, Q_DCS  },   // Transmit
+    { 0,      0,      0,      1,      0,      0,      0,      0      },   // Reverse
+    { SQ_DEFAULT, SQ_TX, SQ_TX, SQ_TX, SQ_DEFAULT, SQ_DEFAULT, SQ_TX, SQ_RX },  // Tone
+    { SQ_DEFAULT, SQ_DEFAULT, SQ_DEFAULT, SQ_DEFAULT, SQ_RX, SQ_TX, SQ_RX, SQ_TX }, // DCS
+    {
+        // Receive none, tone, DCS; transmit none, tone, DCS.
+        { {0}, { 0, T_OFF,  T_TONE,     T_D      },
+               { 0, T_OFF,  T_TSQL,     T_D_TSQL },
+               { 0, T_DTCS, T_T_DCS,    T_DTCS   } },
+        // Reverse receive tone.
+        { {0}, { 0, T_OFF,  T_TONE,     T_D      },
+               { 0, T_OFF,  T_TSQL_REV, T_D_TSQL },
+               { 0, T_DTCS, T_T_DCS,    T_DTCS   } },
+    },
+    TONE_DEFAULT,
+};
 
 //
 // Convert a 3-byte frequency value from binary coded decimal
@@ -532,6 +471,7 @@ static void setup_bank(int bank_index, int chan_index)
 {
     uint8_t *data = &radio_mem[OFFSET_BANKS + bank_index*0x80 + chan_index/8];
 
+    radio_journal(data, 1);
     *data |= 1 << (chan_index & 7);
 }
 
@@ -587,6 +527,7 @@ static void encode_name(int i, char *name)
     memory_name_t *nm = i + (memory_name_t*) &radio_mem[OFFSET_NAMES];
     int n;
 
+    radio_journal(nm, sizeof(*nm));
     if (name && *name && *name != '-') {
         // Setup channel name.
         nm->valid = 1;
@@ -605,6 +546,34 @@ static void encode_name(int i, char *name)
     }
 }
 
+//
+// Map of used channels and PMS records.
+//
+#define NSLOTS          (NCHAN + NPMS*2)
+
+static radio_slots_t used_slots;
+
+//
+// Build the map of used slots from 'used' bits, when the image
+// was replaced.  Edits keep the map up to date.
+//
+static void scan_slots()
+{
+    memory_channel_t *chan = (memory_channel_t*) &radio_mem[OFFSET_CHANNELS];
+    memory_channel_t *pms = (memory_channel_t*) &radio_mem[OFFSET_PMS];
+    int i;
+
+    if (used_slots.valid && used_slots.epoch == radio_mem_epoch)
+        return;
+    memset(&used_slots, 0, sizeof(used_slots));
+    for (i=0; i<NCHAN; i++)
+        radio_slots_set(&used_slots, i, chan[i].used);
+    for (i=0; i<NPMS*2; i++)
+        radio_slots_set(&used_slots, NCHAN + i, pms[i].used);
+    used_slots.epoch = radio_mem_epoch;
+    used_slots.valid = 1;
+}
+
 //
 // Get all parameters for a given channel.
 // Seek selects the type of channel:
@@ -649,34 +618,8 @@ static void decode_channel(int i, int seek, char *name,
     }
 
     // Decode squelch modes.
-    switch (ch->tmode) {
-    case T_TONE:
-        *tx_ctcs = CTCSS_TONES[ch->tone];
-        break;
-    case T_TSQL:
-        *tx_ctcs = CTCSS_TONES[ch->tone];
-        *rx_ctcs = CTCSS_TONES[ch->tone];
-        break;
-    case T_TSQL_REV:
-        *tx_ctcs = CTCSS_TONES[ch->tone];
-        *rx_ctcs = - CTCSS_TONES[ch->tone];
-        break;
-    case T_DTCS:
-        *tx_dcs = DCS_CODES[ch->dtcs];
-        *rx_dcs = DCS_CODES[ch->dtcs];
-        break;
-    case T_D:
-        *tx_dcs = DCS_CODES[ch->dtcs];
-        break;
-    case T_T_DCS:
-        *tx_ctcs = CTCSS_TONES[ch->tone];
-        *rx_dcs = DCS_CODES[ch->dtcs];
-        break;
-    case T_D_TSQL:
-        *tx_dcs = DCS_CODES[ch->dtcs];
-        *rx_ctcs = CTCSS_TONES[ch->tone];
-        break;
-    }
+    radio_decode_squelch(&SQUELCH, ch->tmode, ch->tone, ch->dtcs,
+        rx_ctcs, tx_ctcs, rx_dcs, tx_dcs);
 
     // Other parameters.
     *power = ch->power;
@@ -694,6 +637,7 @@ static void setup_channel(int i, char *name, double rx_mhz, double tx_mhz,
 {
     memory_channel_t *ch = i + (memory_channel_t*) &radio_mem[OFFSET_CHANNELS];
 
+    radio_journal(ch, sizeof(*ch));
     hz_to_freq((int) (rx_mhz * 1000000.0), ch->rxfreq);
 
     double offset_mhz = tx_mhz - rx_mhz;
@@ -712,6 +656,7 @@ static void setup_channel(int i, char *name, double rx_mhz, double tx_mhz,
         hz_to_freq((int) (tx_mhz * 1000000.0), ch->txfreq);
     }
     ch->used = (rx_mhz > 0);
+    radio_slots_set(&used_slots, i, ch->used);
     ch->tmode = tmode;
     ch->tone = tone;
     ch->dtcs = dtcs;
@@ -728,7 +673,8 @@ static void setup_channel(int i, char *name, double rx_mhz, double tx_mhz,
 
     // Scan mode.
     unsigned char *scan_data = &radio_mem[OFFSET_SCAN + i/4];
-    int scan_shift = (i & 3) * 2;
+    int scan_shift = 6 - (i & 3) * 2;
+    radio_journal(scan_data, 1);
     *scan_data &= ~(3 << scan_shift);
     *scan_data |= scan << scan_shift;
 
@@ -751,6 +697,7 @@ static void setup_home(int band, double rx_mhz, double tx_mhz,
     case 430: ch += 3; break;
     case 850: ch += 4; break;
     }
+    radio_journal(ch, sizeof(*ch));
     hz_to_freq((int) (rx_mhz * 1000000.0), ch->rxfreq);
 
     double offset_mhz = tx_mhz - rx_mhz;
@@ -791,6 +738,9 @@ static void setup_pms(int i, double lower_mhz, double upper_mhz)
 {
     memory_channel_t *ch = i*2 + (memory_channel_t*) &radio_mem[OFFSET_PMS];
 
+    radio_journal(ch, 2 * sizeof(*ch));
+    radio_slots_set(&used_slots, NCHAN + i*2, lower_mhz != 0);
+    radio_slots_set(&used_slots, NCHAN + i*2 + 1, lower_mhz != 0);
     if (! lower_mhz) {
         ch[0].used = 0;
         ch[1].used = 0;
@@ -838,12 +788,43 @@ static void print_squelch(FILE *out, int ctcs, int dcs)
     else              fprintf(out, "   - ");
 }
 
+//
+// Print a row of the channel table.
+// Disabled channel is skipped.
+//
+static void print_channel(FILE *out, int i)
+{
+    int rx_hz, tx_hz, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs;
+    int power, wide, scan, isam, step;
+    char name[17];
+
+    decode_channel(i, OFFSET_CHANNELS, name, &rx_hz, &tx_hz, &rx_ctcs, &tx_ctcs,
+        &rx_dcs, &tx_dcs, &power, &wide, &scan, &isam, &step);
+    if (rx_hz == 0) {
+        // Channel is disabled
+        return;
+    }
+    TRACE2(row_render, 'C', i);
+
+    fprintf(out, "%5d   %-7s %8.4f ", i+1, name[0] ? name : "-", rx_hz / 1000000.0);
+    print_offset(out, rx_hz, tx_hz);
+    fprintf(out, " ");
+    print_squelch(out, rx_ctcs, rx_dcs);
+    fprintf(out, "   ");
+    print_squelch(out, tx_ctcs, tx_dcs);
+
+    fprintf(out, "   %-4s  %-10s %s\n", POWER_NAME[power],
+        isam ? "AM" : wide ? "Wide" : "Narrow", SCAN_NAME[scan]);
+}
+
 //
 // Print full information about the device configuration.
 //
 static void ft60_print_config(FILE *out, int verbose)
 {
-    int i;
+    int i, s;
+
+    scan_slots();
 
     fprintf(out, "Radio: Yaesu FT-60R\n");
 
@@ -865,28 +846,9 @@ static void ft60_print_config(FILE *out, int verbose)
         fprintf(out, "#\n");
     }
     fprintf(out, "Channel Name    Receive  Transmit R-Squel T-Squel Power Modulation Scan\n");
-    for (i=0; i<NCHAN; i++) {
-        int rx_hz, tx_hz, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs;
-        int power, wide, scan, isam, step;
-        char name[17];
-
-        decode_channel(i, OFFSET_CHANNELS, name, &rx_hz, &tx_hz, &rx_ctcs, &tx_ctcs,
-            &rx_dcs, &tx_dcs, &power, &wide, &scan, &isam, &step);
-        if (rx_hz == 0) {
-            // Channel is disabled
-            continue;
-        }
-
-        fprintf(out, "%5d   %-7s %8.4f ", i+1, name[0] ? name : "-", rx_hz / 1000000.0);
-        print_offset(out, rx_hz, tx_hz);
-        fprintf(out, " ");
-        print_squelch(out, rx_ctcs, rx_dcs);
-        fprintf(out, "   ");
-        print_squelch(out, tx_ctcs, tx_dcs);
-
-        fprintf(out, "   %-4s  %-10s %s\n", POWER_NAME[power],
-            isam ? "AM" : wide ? "Wide" : "Narrow", SCAN_NAME[scan]);
-    }
+    for (i=radio_slots_next(&used_slots, 0, NCHAN); i<NCHAN;
+         i=radio_slots_next(&used_slots, i+1, NCHAN))
+        print_channel(out, i);
     if (verbose)
         print_squelch_tones(out, 1);
 
@@ -954,10 +916,14 @@ static void ft60_print_config(FILE *out, int verbose)
         fprintf(out, "#\n");
     }
     fprintf(out, "PMS     Lower    Upper\n");
-    for (i=0; i<NPMS; i++) {
+    for (s=radio_slots_next(&used_slots, NCHAN, NSLOTS); s<NSLOTS;
+         s=radio_slots_next(&used_slots, NCHAN + (i+1)*2, NSLOTS)) {
         int lower_hz, upper_hz, tx_hz, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs;
         int power, wide, scan, isam, step;
 
+        // Both records of the pair.
+        i = (s - NCHAN) / 2;
+
         decode_channel(i*2, OFFSET_PMS, 0, &lower_hz, &tx_hz, &rx_ctcs, &tx_ctcs,
             &rx_dcs, &tx_dcs, &power, &wide, &scan, &isam, &step);
         decode_channel(i*2+1, OFFSET_PMS, 0, &upper_hz, &tx_hz, &rx_ctcs, &tx_ctcs,
@@ -1006,6 +972,69 @@ static void ft60_print_config(FILE *out, int verbose)
 #endif
 }
 
+//
+// Packed BCD frequency as an integer of the same order:
+// digits from hundreds of MHz down to tens of kHz,
+// then the number of 2.5 kHz steps.
+//
+static inline unsigned bcd_key(const uint8_t *bcd)
+{
+    return (bcd[0] & 15) << 18 | bcd[1] << 10 | bcd[2] << 2 | bcd[0] >> 6;
+}
+
+static const char *WIDTH_NAME[] = { "Wide", "Narrow", "AM" };
+
+//
+// Print memory channels matching the query.
+// Predicates are compiled into checks of raw channel data,
+// only matching channels are decoded.
+// Return the number of matches.
+//
+static int ft60_query(FILE *out, const radio_query_t *q)
+{
+    memory_channel_t *chan = (memory_channel_t*) &radio_mem[OFFSET_CHANNELS];
+    unsigned tmodes, powers, widths, scans, lo = 0, hi = ~0;
+    int tone, dtcs, i, nmatch = 0;
+    short match[NCHAN+1];
+
+    if (q->rx_lo) {
+        uint8_t bcd[3];
+
+        hz_to_freq(q->rx_lo, bcd);
+        lo = bcd_key(bcd);
+        hz_to_freq(q->rx_hi, bcd);
+        hi = bcd_key(bcd);
+    }
+    tmodes = radio_query_tmodes(q, &SQUELCH, &tone, &dtcs);
+    powers = radio_query_names(q->power, "power", POWER_NAME, 4);
+    widths = radio_query_names(q->mod, "modulation", WIDTH_NAME, 3);
+    scans  = radio_query_names(q->scan, "scan mode", SCAN_NAME, 4);
+
+    // Check used channels without branches.
+    scan_slots();
+    for (i=radio_slots_next(&used_slots, 0, NCHAN); i<NCHAN;
+         i=radio_slots_next(&used_slots, i+1, NCHAN)) {
+        memory_channel_t *ch = &chan[i];
+        unsigned key   = bcd_key(ch->rxfreq);
+        unsigned scan  = radio_mem[OFFSET_SCAN + i/4] >> (6 - (i & 3) * 2) & 3;
+        unsigned width = ch->isam ? 2 : ch->isnarrow;
+
+        match[nmatch] = i;
+        nmatch += (key >= lo) & (key <= hi) &
+                  (tmodes >> ch->tmode) &
+                  (tone < 0 || ch->tone == tone) &
+                  (dtcs < 0 || ch->dtcs == dtcs) &
+                  (powers >> ch->power) & (widths >> width) & (scans >> scan) & 1;
+    }
+    if (nmatch == 0)
+        return 0;
+
+    fprintf(out, "Channel Name    Receive  Transmit R-Squel T-Squel Power Modulation Scan\n");
+    for (i=0; i<nmatch; i++)
+        print_channel(out, match[i]);
+    return nmatch;
+}
+
 //
 // Read memory image from the binary file.
 //
@@ -1095,6 +1124,18 @@ static int default_step(double mhz)
 }
 #endif
 
+//
+// Erase all memory channels.
+//
+static void erase_channels()
+{
+    int i;
+
+    for (i=0; i<NCHAN; i++) {
+        setup_channel(i, 0, 0, 0, 0, TONE_DEFAULT, 0, 0, 1, 0, 0);
+    }
+}
+
 //
 // Parse one line of memory channel table.
 // Start_flag is 1 for the first table row.
@@ -1120,6 +1161,13 @@ static int parse_channel(int first_row, char *line)
         return 0;
     }
 
+    if (rxfreq_str[0] == '-' && rxfreq_str[1] == 0) {
+        // Empty channel.
+        if (first_row == ROW_FIRST)
+            erase_channels();
+        setup_channel(num-1, 0, 0, 0, 0, TONE_DEFAULT, 0, 0, 1, 0, 0);
+        return 1;
+    }
     if (sscanf(rxfreq_str, "%lf", &rx_mhz) != 1 ||
         ! is_valid_frequency(rx_mhz)) {
         fprintf(stderr, "Bad receive frequency.\n");
@@ -1134,11 +1182,12 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
     if (! is_valid_frequency(tx_mhz))
         goto badtx;
 
-    tmode = encode_squelch(rq_str, tq_str, &tone, &dtcs);
+    tmode = radio_encode_squelch(&SQUELCH, rq_str, tq_str, &tone, &dtcs);
 
     if (strcasecmp("High", power_str) == 0) {
         power = 0;
-    } else if (strcasecmp("Mid", power_str) == 0) {
+    } else if (strcasecmp("Mid", power_str) == 0 ||
+               strcasecmp("Med", power_str) == 0) {
         power = 1;
     } else if (strcasecmp("Low", power_str) == 0) {
         power = 2;
@@ -1172,12 +1221,9 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         return 0;
     }
 
-    if (first_row) {
+    if (first_row == ROW_FIRST) {
         // On first entry, erase the channel table.
-        int i;
-        for (i=0; i<NCHAN; i++) {
-            setup_channel(i, 0, 0, 0, 0, TONE_DEFAULT, 0, 0, 1, 0, 0);
-        }
+        erase_channels();
     }
 
     setup_channel(num-1, name_str, rx_mhz, tx_mhz,
@@ -1223,11 +1269,12 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
     if (! is_valid_frequency(tx_mhz))
         goto badtx;
 
-    tmode = encode_squelch(rq_str, tq_str, &tone, &dtcs);
+    tmode = radio_encode_squelch(&SQUELCH, rq_str, tq_str, &tone, &dtcs);
 
     if (strcasecmp("High", power_str) == 0) {
         power = 0;
-    } else if (strcasecmp("Mid", power_str) == 0) {
+    } else if (strcasecmp("Mid", power_str) == 0 ||
+               strcasecmp("Med", power_str) == 0) {
         power = 1;
     } else if (strcasecmp("Low", power_str) == 0) {
         power = 2;
@@ -1284,7 +1331,7 @@ static int parse_pms(int first_row, char *line)
         return 0;
     }
 
-    if (first_row) {
+    if (first_row == ROW_FIRST) {
         // On first entry, erase the PMS table.
         int i;
         for (i=0; i<NPMS; i++) {
@@ -1295,6 +1342,11 @@ static int parse_pms(int first_row, char *line)
     return 1;
 }
 
+//
+// Banks already listed in the current fragment.
+//
+static unsigned banks_replaced;
+
 //
 // Parse one line of Banks table.
 // Return 0 on failure.
@@ -1313,9 +1365,17 @@ static int parse_banks(int first_row, char *line)
         return 0;
     }
 
-    if (first_row) {
+    if (first_row == ROW_FIRST) {
         // On first entry, erase the Banks table.
-        memset(&radio_mem[OFFSET_BANKS], 0, NBANKS * 0x80);
+        radio_memset(&radio_mem[OFFSET_BANKS], 0, NBANKS * 0x80);
+    }
+
+    // Bank listed in a later fragment replaces the previous contents.
+    if (first_row)
+        banks_replaced = 0;
+    if (! (banks_replaced & (1 << (bnum-1)))) {
+        banks_replaced |= 1 << (bnum-1);
+        radio_memset(&radio_mem[OFFSET_BANKS + (bnum-1) * 0x80], 0, 0x80);
     }
 
     if (*chan_str == '-')
@@ -1399,12 +1459,68 @@ static int ft60_parse_row(int table_id, int first_row, char *line)
     return 0;
 }
 
+//
+// Find the next used memory channel, starting from index i.
+// Return its index, with name and receive frequency, or NCHAN.
+//
+static int ft60_next_channel(int i, char *name, int *rx_hz)
+{
+    memory_channel_t *ch = (memory_channel_t*) &radio_mem[OFFSET_CHANNELS];
+
+    scan_slots();
+    i = radio_slots_next(&used_slots, i, NCHAN);
+    if (i < NCHAN) {
+        *name = 0;
+        decode_name(i, name);
+        *rx_hz = freq_to_hz(ch[i].rxfreq);
+    }
+    return i;
+}
+
+//
+// Rewrite one memory channel from a row of the channel table.
+// Return 0 on failure.
+//
+static int ft60_set_channel(char *line)
+{
+    return parse_channel(ROW_NEXT, line);
+}
+
+//
+// Clear the memory channel, and remove it from all banks.
+//
+static void ft60_erase_channel(int i)
+{
+    int b;
+
+    setup_channel(i, 0, 0, 0, 0, TONE_DEFAULT, 0, 0, 1, 0, 0);
+    for (b=0; b<NBANKS; b++) {
+        uint8_t *data = &radio_mem[OFFSET_BANKS + b*0x80 + i/8];
+
+        if (*data & (1 << (i & 7))) {
+            radio_journal(data, 1);
+            *data &= ~(1 << (i & 7));
+        }
+    }
+}
+
+//
+// Stable regions for the fingerprint: the header and the settings,
+// which arrive in the first two blocks.
+//
+static const radio_region_t FINGERPRINT[] = {
+    { 0, OFFSET_VFO },
+    { 0, 0 },
+};
+
 //
 // Yaesu FT-60R
 //
 radio_device_t radio_ft60 = {
     "Yaesu FT-60R",
     9600,
+    NCHAN,
+    FINGERPRINT,
     ft60_download,
     ft60_upload,
     ft60_is_compatible,
@@ -1415,4 +1531,10 @@ radio_device_t radio_ft60 = {
     ft60_parse_parameter,
     ft60_parse_header,
     ft60_parse_row,
+    ft60_query,
+    ft60_wire,
+    ft60_next_channel,
+    print_channel,
+    ft60_set_channel,
+    ft60_erase_channel,
 };
@@ -0,0 +1,439 @@
+/*
+ * Health of serial ports and cables, from timing of the clone protocol.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#ifndef MINGW32
+#   include <sys/file.h>
+#endif
+#include "radio.h"
+#include "util.h"
+
+//
+// Store of session summaries, in the cache directory.
+// One line per session:
+//      time port adapter model ok acks p50 p90 p99 echo retry timeout
+// Times of acknowledge are in microseconds.
+//
+#define HEALTH_FILE     "health.log"
+
+//
+// When the store grows above this size, only the newer half is kept.
+//
+#define HEALTH_MAXSIZE  (256*1024)
+
+//
+// Score of a port is computed from this many last sessions,
+// every older session with a lower weight.
+//
+#define HEALTH_WINDOW   20
+#define HEALTH_DECAY    0.85
+
+//
+// Acknowledge slower than this is a sign of a bad adapter.
+//
+#define HEALTH_SLOW_USEC 100000
+
+#define MAXSAMPLES      1024            // Acks timed per session
+#define MAXPORTS        64              // Ports in the report
+
+//
+// Summary of one session.
+//
+typedef struct {
+    char port [128];                    // Serial port
+    char adapter [256];                 // Hardware path of the adapter
+    char model [32];                    // Radio type: ft60, vx2
+    int ok;                             // Session completed
+    int acks;                           // Number of acknowledges
+    int p50, p90, p99;                  // Percentiles of ack time, usec
+    int count [3];                      // Events: echo, retry, timeout
+} session_t;
+
+//
+// Rolling state of a port, for the report.
+//
+typedef struct {
+    char port [128];
+    char adapter [256];
+    int nsessions;                      // Sessions with this adapter
+    session_t last [HEALTH_WINDOW];     // Ring of last sessions
+} port_t;
+
+static session_t session;               // Current session
+static int session_open;                // Between begin and end
+static volatile sig_atomic_t interrupted; // Signal of the operator, or 0
+static int sample [MAXSAMPLES];         // Ack times of the session, usec
+static int nsamples;
+
+//
+// Copy the name into a field of the store: no spaces allowed.
+//
+static void copy_word(char *dest, const char *src, int size)
+{
+    int i;
+
+    for (i=0; i<size-1 && src[i]; i++)
+        dest[i] = (src[i] <= ' ') ? '?' : src[i];
+    dest[i] = 0;
+    if (i == 0)
+        strcpy(dest, "-");
+}
+
+//
+// Find the hardware path of the adapter, like
+// pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0 for a USB serial cable,
+// so a replaced cable is told from the old one on the same port name.
+//
+static void find_adapter(const char *port_name, char *adapter, int size)
+{
+    if (strstr(port_name, "://")) {
+        copy_word(adapter, "network", size);
+        return;
+    }
+    if (strncmp(port_name, "sim:", 4) == 0) {
+        copy_word(adapter, "simulated", size);
+        return;
+    }
+#ifdef __linux__
+    char path [PATH_MAX], dev [PATH_MAX], sys [PATH_MAX];
+    const char *base;
+
+    if (realpath(port_name, dev)) {
+        base = strrchr(dev, '/');
+        base = base ? base+1 : dev;
+        snprintf(path, sizeof(path), "/sys/class/tty/%.200s/device", base);
+        if (realpath(path, sys)) {
+            base = sys;
+            if (strncmp(base, "/sys/devices/", 13) == 0)
+                base += 13;
+            copy_word(adapter, base, size);
+            return;
+        }
+    }
+#endif
+    copy_word(adapter, "-", size);
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+//
+// Append the summary of the session to the store.
+// Writers are serialized by a lock on the file.
+// The simulated radio tells nothing about real ports,
+// so its sessions are not recorded.
+//
+static void save_session()
+{
+    const char *dir = radio_cache_dir();
+    char path [1100], line [600];
+    int fd, len;
+    off_t size;
+
+    if (! dir || strcmp(session.adapter, "simulated") == 0)
+        return;
+    if (nsamples > 0) {
+        qsort(sample, nsamples, sizeof(int), compare_int);
+        session.p50 = sample[nsamples * 50 / 100];
+        session.p90 = sample[nsamples * 90 / 100];
+        session.p99 = sample[nsamples * 99 / 100];
+    }
+    len = snprintf(line, sizeof(line), "%ld %s %s %s %d %d %d %d %d %d %d %d\n",
+        (long) (clock_usec() / 1000000), session.port, session.adapter, session.model,
+        session.ok, session.acks, session.p50, session.p90, session.p99,
+        session.count[HEALTH_ECHO], session.count[HEALTH_RETRY],
+        session.count[HEALTH_TIMEOUT]);
+
+    snprintf(path, sizeof(path), "%s/%s", dir, HEALTH_FILE);
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return;
+#ifndef MINGW32
+    flock(fd, LOCK_EX);
+#endif
+    size = lseek(fd, 0, SEEK_END);
+    if (size > HEALTH_MAXSIZE) {
+        // Keep the newer half of the store, from a line start.
+        char *buf = malloc(size), *tail;
+
+        if (buf && pread(fd, buf, size, 0) == size) {
+            tail = memchr(buf + size/2, '\n', size - size/2);
+            if (tail) {
+                tail++;
+                if (ftruncate(fd, 0) == 0 &&
+                    write(fd, tail, buf + size - tail) < 0)
+                    perror(path);
+            }
+        }
+        free(buf);
+    }
+    if (write(fd, line, len) != len)
+        perror(path);
+    close(fd);
+}
+
+//
+// Record the failed session, when the program halts in the middle of it.
+// Sessions which did not reach the radio tell nothing about the port.
+// After ^C, die by the signal, as the operator expects.
+//
+static void end_on_exit()
+{
+    if (session_open) {
+        session_open = 0;
+        if (session.acks != 0 || session.count[HEALTH_ECHO] != 0 ||
+            session.count[HEALTH_RETRY] != 0 || session.count[HEALTH_TIMEOUT] != 0) {
+            session.ok = 0;
+            save_session();
+        }
+    }
+    if (interrupted) {
+        signal(interrupted, SIG_DFL);
+        raise(interrupted);
+    }
+}
+
+//
+// Operator gave up on the session.  Only set the flag: the protocol
+// stops at the next read from the port, and the session is recorded
+// as failed on exit, when the protocol thread does not touch it.
+//
+static void end_on_signal(int sig)
+{
+    if (! session_open) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    interrupted = sig;
+}
+
+//
+// Stop the protocol when the operator pressed ^C.
+//
+void radio_health_check()
+{
+    if (interrupted) {
+        radio_message(0, "\nInterrupted.\n");
+        radio_fail();
+    }
+}
+
+//
+// Start the summary of a session on the port.
+// Signals do not restart reads of the terminal, so ^C
+// also ends the wait for <Enter>.
+//
+void radio_health_begin(const char *port_name)
+{
+    static int registered;
+
+    memset(&session, 0, sizeof(session));
+    copy_word(session.port, port_name, sizeof(session.port));
+    find_adapter(port_name, session.adapter, sizeof(session.adapter));
+    copy_word(session.model, radio_type(), sizeof(session.model));
+    nsamples = 0;
+    session_open = 1;
+    if (! registered) {
+        atexit(end_on_exit);
+#ifdef MINGW32
+        signal(SIGINT, end_on_signal);
+        signal(SIGTERM, end_on_signal);
+#else
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = end_on_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, 0);
+        sigaction(SIGTERM, &sa, 0);
+#endif
+        registered = 1;
+    }
+}
+
+//
+// Read acknowledge of the radio, and measure the time it takes.
+// Return the number of bytes received: 1, or 0 on timeout.
+//
+int radio_read_ack(int fd, unsigned char *reply)
+{
+    long long t0;
+    int len;
+
+    radio_health_check();
+    t0 = clock_usec();
+    len = serial_read(fd, reply, 1);
+
+    if (len != 1) {
+        radio_health_event(HEALTH_TIMEOUT);
+        return 0;
+    }
+    if (nsamples < MAXSAMPLES)
+        sample[nsamples++] = clock_usec() - t0;
+    session.acks++;
+    return 1;
+}
+
+//
+// Count a problem of the session.
+//
+void radio_health_event(int kind)
+{
+    session.count[kind]++;
+}
+
+//
+// Complete the session, and append its summary to the store.
+//
+void radio_health_end()
+{
+    if (! session_open)
+        return;
+    session_open = 0;
+    session.ok = 1;
+    save_session();
+}
+
+//
+// Quality of one session: 1 for a clean one, 0 for a failure.
+//
+static double session_quality(const session_t *s)
+{
+    double q = 1;
+
+    if (! s->ok)
+        return 0;
+    q -= 0.2 * s->count[HEALTH_RETRY];
+    q -= 0.2 * s->count[HEALTH_TIMEOUT];
+    q -= 0.1 * s->count[HEALTH_ECHO];
+    if (s->p99 > HEALTH_SLOW_USEC)
+        q -= 0.2;
+    return (q < 0) ? 0 : q;
+}
+
+//
+// Find the port in the table, or add it.
+//
+static port_t *find_port(port_t *tab, int *nports, const char *name)
+{
+    int i;
+
+    for (i=0; i<*nports; i++)
+        if (strcmp(tab[i].port, name) == 0)
+            return &tab[i];
+    if (*nports >= MAXPORTS)
+        return 0;
+    strcpy(tab[*nports].port, name);
+    return &tab[(*nports)++];
+}
+
+static int compare_port(const void *a, const void *b)
+{
+    return strcmp(((const port_t*)a)->port, ((const port_t*)b)->port);
+}
+
+//
+// Print the health of every port, from the store.
+// Score is 100 for a port with clean recent sessions.
+// When the adapter of a port changes, its history starts anew.
+//
+void radio_health_report(FILE *out)
+{
+    const char *dir = radio_cache_dir();
+    static port_t tab [MAXPORTS];
+    char path [1100], line [600];
+    int nports = 0, i, k, n, failed, events;
+    session_t s;
+    port_t *p;
+    FILE *fp;
+
+    if (! dir) {
+        fprintf(stderr, "No cache directory for the health store.\n");
+        exit(-1);
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, HEALTH_FILE);
+    fp = fopen(path, "r");
+    if (! fp) {
+        perror(path);
+        exit(-1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        memset(&s, 0, sizeof(s));
+        if (sscanf(line, "%*d %127s %255s %31s %d %d %d %d %d %d %d %d",
+                s.port, s.adapter, s.model, &s.ok, &s.acks,
+                &s.p50, &s.p90, &s.p99, &s.count[HEALTH_ECHO],
+                &s.count[HEALTH_RETRY], &s.count[HEALTH_TIMEOUT]) != 11)
+            continue;
+        p = find_port(tab, &nports, s.port);
+        if (! p)
+            continue;
+        if (strcmp(p->adapter, s.adapter) != 0) {
+            // Another cable on this port.
+            strcpy(p->adapter, s.adapter);
+            p->nsessions = 0;
+        }
+        p->last[p->nsessions % HEALTH_WINDOW] = s;
+        p->nsessions++;
+    }
+    fclose(fp);
+    qsort(tab, nports, sizeof(port_t), compare_port);
+
+    fprintf(out, "# Port Sessions Failed Events Ack-p50 Ack-p99 Score Adapter\n");
+    for (i=0; i<nports; i++) {
+        double sum = 0, wsum = 0, w = 1;
+        const session_t *latest = 0;
+
+        p = &tab[i];
+        n = (p->nsessions < HEALTH_WINDOW) ? p->nsessions : HEALTH_WINDOW;
+        failed = events = 0;
+        for (k=0; k<n; k++) {
+            // From the newest to older sessions.
+            const session_t *r = &p->last[(p->nsessions - 1 - k) % HEALTH_WINDOW];
+
+            if (! latest)
+                latest = r;
+            sum += w * session_quality(r);
+            wsum += w;
+            w *= HEALTH_DECAY;
+            failed += ! r->ok;
+            events += r->count[HEALTH_ECHO] + r->count[HEALTH_RETRY] +
+                      r->count[HEALTH_TIMEOUT];
+        }
+        fprintf(out, "%s %d %d %d %.1f %.1f %.0f %s\n", p->port, n, failed,
+            events, latest->p50 / 1000.0, latest->p99 / 1000.0,
+            100 * sum / wsum, p->adapter);
+    }
+}
@@ -0,0 +1,473 @@
+/*
+ * Station load test: run many yaesutool sessions at once
+ * against simulated radios on pseudo-terminals.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/resource.h>
+
+#define MAXRADIOS       256
+#define MAXBLOCKS       1024
+
+//
+// Clone protocol of a radio model.
+//
+typedef struct {
+    const char *type;           // Option -t of yaesutool
+    const char *ident;          // Image header
+    int memsz;                  // Image size, without checksum
+    int baud;                   // Default baud rate
+    int first[2];               // Sizes of header blocks, acknowledged
+    int bulk_ack;               // Bulk blocks are acknowledged
+    int pace_first;             // Pause of the tool before the second header
+                                // block and the bulk, on upload, usec
+    int pace_bulk;              // Pause between bulk blocks, on upload, usec
+} model_t;
+
+static const model_t FT60 = { "ft60", "AH017$", 0x6fc8, 9600,  { 8, 0 },  1, 0, 0 };
+static const model_t VX2  = { "vx2",  "AH015$", 32594,  19200, { 10, 8 }, 0, 500000, 60000 };
+
+//
+// Simulated radio on a pseudo-terminal.
+//
+typedef struct {
+    const model_t *model;
+    int master;                 // Master side of pty
+    char slave [64];            // Name of slave device
+    char dir [64];              // Working directory of the session
+    int baud;                   // Simulated line speed
+    unsigned char *image;       // Image data with checksum
+    int nblocks;                // Block sizes in the clone stream
+    int block [MAXBLOCKS];
+    int need_ack [MAXBLOCKS];
+    int pace [MAXBLOCKS];       // Pause of the tool before the block, usec
+    int nack;                   // Turnaround times, usec
+    int *ack_usec;
+    int ok;                     // Session completed
+    long long t_start, t_end;   // Session time, usec
+    pid_t pid;                  // Process of yaesutool
+} radio_t;
+
+static radio_t radio [MAXRADIOS];
+static int nradios = 4;
+static int upload_mode;         // Test -w instead of read
+static int deadline_msec = 100; // Deadline for turnaround
+static const char *tool = "./yaesutool";
+
+//
+// Get monotonic time in microseconds.
+//
+static long long now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//
+// Simulate wire time of nbytes at the given baud rate: 10 bits per byte.
+//
+static void wire_delay(radio_t *r, int nbytes)
+{
+    usleep(nbytes * 10000000LL / r->baud);
+}
+
+//
+// Read exactly nbytes from the pty, echoing them back
+// like the single-wire programming cable does.
+// Return 0 on timeout.
+//
+static int read_echo(radio_t *r, unsigned char *data, int nbytes, int timeout_msec)
+{
+    while (nbytes > 0) {
+        fd_set rset;
+        struct timeval timo;
+        int n;
+
+        FD_ZERO(&rset);
+        FD_SET(r->master, &rset);
+        timo.tv_sec = timeout_msec / 1000;
+        timo.tv_usec = timeout_msec % 1000 * 1000;
+        if (select(r->master + 1, &rset, 0, 0, &timo) != 1)
+            return 0;
+        n = read(r->master, data, nbytes);
+        if (n <= 0)
+            return 0;
+        if (write(r->master, data, n) != n)
+            return 0;
+        data += n;
+        nbytes -= n;
+    }
+    return 1;
+}
+
+//
+// Wait until yaesutool puts the slave side into raw mode.
+// Return 0 on timeout.
+//
+static int wait_raw_mode(radio_t *r)
+{
+    struct termios tio;
+    int i;
+
+    for (i=0; i<1000; i++) {
+        if (tcgetattr(r->master, &tio) == 0 && ! (tio.c_lflag & ICANON)) {
+            // Let the tool flush its input.
+            usleep(100000);
+            return 1;
+        }
+        usleep(10000);
+    }
+    return 0;
+}
+
+//
+// Record turnaround time of the tool: from the end of a block
+// until the acknowledge, or until the next block.  On upload, the
+// pause which the protocol requires before the next block is not
+// a delay of the tool, so it is not counted.
+//
+static void add_ack(radio_t *r, long long usec)
+{
+    r->ack_usec = realloc(r->ack_usec, (r->nack + 1) * sizeof(int));
+    r->ack_usec[r->nack++] = usec;
+}
+
+//
+// Radio sends the image: clone mode, PTT pressed.
+//
+static void radio_send(radio_t *r)
+{
+    unsigned char ack;
+    int i, addr;
+
+    if (! wait_raw_mode(r))
+        return;
+    r->t_start = now_usec();
+    for (i=0, addr=0; i<r->nblocks; addr+=r->block[i++]) {
+        if (write(r->master, &r->image[addr], r->block[i]) != r->block[i])
+            return;
+        wire_delay(r, r->block[i]);
+        if (r->need_ack[i]) {
+            long long t0 = now_usec();
+            if (! read_echo(r, &ack, 1, 2000) || ack != 0x06)
+                return;
+            add_ack(r, now_usec() - t0);
+        }
+    }
+    r->ok = 1;
+}
+
+//
+// Radio receives the image: clone mode, MONI or V/M pressed.
+//
+static void radio_receive(radio_t *r)
+{
+    unsigned char *data = malloc(r->model->memsz + 1);
+    long long t0 = 0;
+    int i, addr;
+
+    for (i=0, addr=0; i<r->nblocks; addr+=r->block[i++]) {
+        if (! read_echo(r, &data[addr], 1, i ? 2000 : 60000))
+            goto done;
+        if (i == 0)
+            r->t_start = now_usec();
+        else {
+            long long usec = now_usec() - t0 - r->pace[i];
+            add_ack(r, usec > 0 ? usec : 0);
+        }
+        if (! read_echo(r, &data[addr+1], r->block[i] - 1, 2000))
+            goto done;
+
+        // The tool paces from the echo of the block, or from the acknowledge.
+        t0 = now_usec();
+        wire_delay(r, r->block[i]);
+        if (r->need_ack[i]) {
+            if (write(r->master, "\x06", 1) != 1)
+                goto done;
+            t0 = now_usec();
+        }
+    }
+
+    // Image must arrive intact.
+    r->ok = (memcmp(data, r->image, r->model->memsz + 1) == 0);
+done:
+    free(data);
+}
+
+//
+// Thread of a simulated radio.
+//
+static void *radio_thread(void *arg)
+{
+    radio_t *r = arg;
+
+    if (upload_mode)
+        radio_receive(r);
+    else
+        radio_send(r);
+    r->t_end = now_usec();
+    return 0;
+}
+
+//
+// Create a radio: pty, image and list of blocks.
+//
+static void radio_init(radio_t *r, const model_t *m, int baud, int index)
+{
+    int i, addr, sum, n;
+
+    r->model = m;
+    r->baud = baud ? baud : m->baud;
+    r->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (r->master < 0 || grantpt(r->master) < 0 || unlockpt(r->master) < 0) {
+        perror("posix_openpt");
+        exit(-1);
+    }
+    strncpy(r->slave, ptsname(r->master), sizeof(r->slave)-1);
+
+    // Blank image with valid header and checksum.
+    r->image = malloc(m->memsz + 1);
+    memset(r->image, 0xff, m->memsz);
+    memcpy(r->image, m->ident, strlen(m->ident));
+    for (sum=0, addr=0; addr<m->memsz; addr++)
+        sum += r->image[addr];
+    r->image[m->memsz] = sum;
+
+    // Header blocks, then bulk blocks of 64 bytes, checksum last.
+    r->nblocks = 0;
+    addr = 0;
+    for (i=0; i<2 && m->first[i]; i++) {
+        r->pace[r->nblocks] = i ? m->pace_first : 0;
+        r->need_ack[r->nblocks] = 1;
+        r->block[r->nblocks++] = m->first[i];
+        addr += m->first[i];
+    }
+    while (addr < m->memsz + 1) {
+        n = m->memsz + 1 - addr;
+        if (m->bulk_ack && addr < m->memsz && n > m->memsz - addr)
+            n = m->memsz - addr;
+        if (n > 64)
+            n = 64;
+        // Longer pause after the header blocks.
+        r->pace[r->nblocks] = (r->nblocks == i) ? m->pace_first : m->pace_bulk;
+        r->need_ack[r->nblocks] = m->bulk_ack;
+        r->block[r->nblocks++] = n;
+        addr += n;
+    }
+
+    // Each session runs in its own directory.
+    snprintf(r->dir, sizeof(r->dir), "/tmp/loadtest.%d.%d", getpid(), index);
+    mkdir(r->dir, 0755);
+    if (upload_mode) {
+        char path [128];
+        snprintf(path, sizeof(path), "%s/image.img", r->dir);
+        FILE *f = fopen(path, "wb");
+        if (! f) {
+            perror(path);
+            exit(-1);
+        }
+        fwrite(r->image, 1, m->memsz + 1, f);
+        fclose(f);
+    }
+}
+
+//
+// Start yaesutool against the radio.
+//
+static void session_start(radio_t *r)
+{
+    r->pid = fork();
+    if (r->pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (r->pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+
+        if (chdir(r->dir) < 0)
+            _exit(-1);
+
+        // Keep the cache and health store of the test sessions
+        // away from the store of the real ports.
+        setenv("YAESUTOOL_CACHE", r->dir, 1);
+        dup2(null, 0);
+        dup2(null, 1);
+        dup2(null, 2);
+        if (upload_mode)
+            execl(tool, tool, "-w", "-t", r->model->type, r->slave, "image.img", (char*)0);
+        else
+            execl(tool, tool, "-t", r->model->type, r->slave, (char*)0);
+        _exit(-1);
+    }
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+//
+// Print percentiles of a list of values, in milliseconds.
+//
+static void print_percentiles(const char *title, int *val, int n)
+{
+    if (n == 0) {
+        printf("%-20s -\n", title);
+        return;
+    }
+    qsort(val, n, sizeof(int), compare_int);
+    printf("%-20s p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f msec\n", title,
+        val[n/2] / 1000.0, val[n*90/100] / 1000.0,
+        val[n*99/100] / 1000.0, val[n-1] / 1000.0);
+}
+
+static void usage()
+{
+    fprintf(stderr, "Station load test: simulated radios on pseudo-terminals.\n");
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "    loadtest [options]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -n count     Number of radios, default 4\n");
+    fprintf(stderr, "    -t type      Type of radios: ft60, vx2 or mix, default mix\n");
+    fprintf(stderr, "    -b baud      Simulated line speed, default per model\n");
+    fprintf(stderr, "    -d msec      Deadline for turnaround, default 100\n");
+    fprintf(stderr, "    -w           Test image write instead of read\n");
+    fprintf(stderr, "    -y path      Path to yaesutool, default ./yaesutool\n");
+    exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *type = "mix";
+    int baud = 0, i, n, nack, nlate, nok, *session_usec, *ack_usec;
+    long long t0, t1, total_bytes;
+    struct rusage ru;
+    pthread_t tid [MAXRADIOS];
+
+    for (;;) {
+        switch (getopt(argc, argv, "n:t:b:d:wy:")) {
+        case 'n': nradios = atoi(optarg);       continue;
+        case 't': type = optarg;                continue;
+        case 'b': baud = atoi(optarg);          continue;
+        case 'd': deadline_msec = atoi(optarg); continue;
+        case 'w': upload_mode = 1;              continue;
+        case 'y': tool = optarg;                continue;
+        default:
+            usage();
+        case EOF:
+            break;
+        }
+        break;
+    }
+    if (optind != argc || nradios < 1 || nradios > MAXRADIOS)
+        usage();
+    // Sessions run in other directories: need absolute path.
+    tool = realpath(tool, 0);
+    if (! tool || access(tool, X_OK) < 0) {
+        perror("yaesutool");
+        exit(-1);
+    }
+
+    for (i=0; i<nradios; i++) {
+        const model_t *m = (strcmp(type, "ft60") == 0) ? &FT60 :
+                           (strcmp(type, "vx2") == 0)  ? &VX2 :
+                           (i & 1)                     ? &VX2 : &FT60;
+        radio_init(&radio[i], m, baud, i);
+    }
+
+    printf("Start %d %s sessions.\n", nradios, upload_mode ? "write" : "read");
+    t0 = now_usec();
+    for (i=0; i<nradios; i++) {
+        session_start(&radio[i]);
+        pthread_create(&tid[i], 0, radio_thread, &radio[i]);
+    }
+    for (i=0; i<nradios; i++) {
+        int status;
+        pthread_join(tid[i], 0);
+        waitpid(radio[i].pid, &status, 0);
+        if (! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            radio[i].ok = 0;
+    }
+    t1 = now_usec();
+    getrusage(RUSAGE_CHILDREN, &ru);
+
+    // Collect statistics.
+    session_usec = malloc(nradios * sizeof(int));
+    for (nack=0, i=0; i<nradios; i++)
+        nack += radio[i].nack;
+    ack_usec = malloc((nack + 1) * sizeof(int));
+    nok = nack = nlate = 0;
+    total_bytes = 0;
+    for (i=0; i<nradios; i++) {
+        radio_t *r = &radio[i];
+
+        if (! r->ok) {
+            fprintf(stderr, "Session %d (%s on %s) failed.\n", i, r->model->type, r->slave);
+            continue;
+        }
+        session_usec[nok++] = r->t_end - r->t_start;
+        total_bytes += r->model->memsz + 1;
+        for (n=0; n<r->nack; n++) {
+            ack_usec[nack++] = r->ack_usec[n];
+            if (r->ack_usec[n] > deadline_msec * 1000)
+                nlate++;
+        }
+    }
+
+    printf("Sessions:            %d ok, %d failed\n", nok, nradios - nok);
+    printf("Wall time:           %.2f sec\n", (t1 - t0) / 1000000.0);
+    printf("Throughput:          %.0f bytes/sec aggregate\n", total_bytes * 1000000.0 / (t1 - t0));
+    print_percentiles("Session time:", session_usec, nok);
+    print_percentiles("Turnaround:", ack_usec, nack);
+    printf("Missed deadlines:    %d of %d over %d msec\n", nlate, nack, deadline_msec);
+    printf("CPU usage:           %.2f sec user, %.2f sec system (%.1f%% of one core)\n",
+        ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0,
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0,
+        100.0 * (ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec +
+                 ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec) / (t1 - t0));
+
+    // Remove session directories.
+    for (i=0; i<nradios; i++) {
+        char cmd [128];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", radio[i].dir);
+        if (system(cmd) != 0)
+            /*ignore*/;
+    }
+    return (nok == nradios) ? 0 : 1;
+}
@@ -27,6 +27,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "radio.h"
 #include "util.h"
@@ -49,24 +50,67 @@ void usage()
     fprintf(stderr, _("                                 Write image to device.\n"));
     fprintf(stderr, _("    yaesutool -c [-v] -t type port file.conf\n"));
     fprintf(stderr, _("                                 Configure device from text file.\n"));
+    fprintf(stderr, _("    yaesutool -p plan [-v] port\n"));
+    fprintf(stderr, _("                                 Write golden image to device.\n"));
     fprintf(stderr, _("    yaesutool -c [-v] file.img file.conf\n"));
     fprintf(stderr, _("                                 Apply text configuration to the image.\n"));
     fprintf(stderr, _("    yaesutool file.img\n"));
     fprintf(stderr, _("                                 Display configuration from image file.\n"));
+    fprintf(stderr, _("    yaesutool -e ports [-m timing.txt] [type:op:count...]\n"));
+    fprintf(stderr, _("                                 Estimate session times and station makespan,\n"));
+    fprintf(stderr, _("                                 op is read, write or config.\n"));
+    fprintf(stderr, _("    yaesutool -u old.csv new.csv file.img\n"));
+    fprintf(stderr, _("                                 Update channels of the image by changes of repeater directory.\n"));
+    fprintf(stderr, _("    yaesutool -r fleet.txt [-o dir]\n"));
+    fprintf(stderr, _("                                 List radios out of date: lines 'name file.img file.conf',\n"));
+    fprintf(stderr, _("                                 save desired images to directory.\n"));
+    fprintf(stderr, _("    yaesutool -g bundle.conf [-j jobs] [-o dir]\n"));
+    fprintf(stderr, _("                                 Build images of all sections 'Section: name' of the bundle,\n"));
+    fprintf(stderr, _("                                 save them to directory.\n"));
+    fprintf(stderr, _("    yaesutool -b manifest.txt\n"));
+    fprintf(stderr, _("                                 Run batch job: lines 'apply file.img file.conf output.img',\n"));
+    fprintf(stderr, _("                                 'render file.img output.conf' or 'check file.img'.\n"));
+    fprintf(stderr, _("    yaesutool -q query file.img...\n"));
+    fprintf(stderr, _("                                 Find channels in image files, for example:\n"));
+    fprintf(stderr, _("                                 -q \"rx=144-148 tsq=100.0 scan=Only\"\n"));
+    fprintf(stderr, _("    yaesutool -x script.txt\n"));
+    fprintf(stderr, _("                                 Run commands against images in memory: load, use, copy,\n"));
+    fprintf(stderr, _("                                 apply, set, render, save, diff, model, download, upload.\n"));
+    fprintf(stderr, _("    yaesutool -H\n"));
+    fprintf(stderr, _("                                 Print health score of every port, from past sessions.\n"));
     fprintf(stderr, _("Options:\n"));
     fprintf(stderr, _("    -w           Write image to device.\n"));
     fprintf(stderr, _("    -c           Configure device from text file.\n"));
+    fprintf(stderr, _("    -s           With -c: keep existing channels in their memory slots.\n"));
+    fprintf(stderr, _("    -T name      With -c: trust the cached image of the named radio, do not read it.\n"));
     fprintf(stderr, _("    -v           Trace serial protocol.\n"));
+    fprintf(stderr, _("    -J file.json Append timeline of the session in Trace Event Format.\n"));
+    fprintf(stderr, _("    -V           Virtual time: no real delays, for port 'sim:file.img'.\n"));
+    fprintf(stderr, _("                 Port 'sim:file.img' is a radio simulated in this process.\n"));
+    fprintf(stderr, _("    -R cpu       Real-time priority for serial protocol, pinned to CPU (-1 for any).\n"));
+    fprintf(stderr, _("    -o file.img  Output image, instead of 'device.img' or 'backup.img'.\n"));
+    fprintf(stderr, _("    -f file.conf Output configuration, instead of 'device.conf'.\n"));
+    fprintf(stderr, _("                 File name '-' means standard input or output.\n"));
     fprintf(stderr, _("    -t type      Type of radio:\n"));
     fprintf(stderr, _("                 ft60 - Yaesu FT-60R\n"));
     fprintf(stderr, _("                 vx2  - Yaesu VX-2R, VX-2E\n"));
+    if (radio_plans[0].name) {
+        fprintf(stderr, _("    -p plan      Golden image built into the program:\n"));
+        radio_print_plans(stderr);
+    }
     exit(-1);
 }
 
 int main(int argc, char **argv)
 {
-    int write_flag = 0, config_flag = 0;
-    const char *type = 0;
+    int write_flag = 0, config_flag = 0, stable_flag = 0;
+    int health_flag = 0;
+    const char *type = 0, *plan = 0, *trust_name = 0;
+    char *query = 0, *manifest = 0, *script = 0, *fleet = 0, *sync_csv = 0, *bundle = 0;
+    const char *timing = 0;
+    char *output_img = 0, *output_conf = 0;
+    FILE *info = stdout;
+    int nports = 0, njobs = 0;
 
     // Set locale and message catalogs.
     setlocale(LC_ALL, "");
@@ -82,11 +126,29 @@ int main(int argc, char **argv)
     copyright = _("Copyright (C) 2018 Serge Vakulenko KK6ABQ");
     serial_verbose = 0;
     for (;;) {
-        switch (getopt(argc, argv, "vcwt:")) {
+        switch (getopt(argc, argv, "vcswHVt:p:q:e:m:o:f:b:x:r:u:g:j:R:J:T:")) {
         case 'v': ++serial_verbose; continue;
         case 'w': ++write_flag;     continue;
         case 'c': ++config_flag;    continue;
+        case 's': ++stable_flag;    continue;
+        case 'T': trust_name = optarg; continue;
+        case 'H': ++health_flag;    continue;
+        case 'V': clock_virtual();  continue;
         case 't': type = optarg;    continue;
+        case 'p': plan = optarg;    continue;
+        case 'q': query = optarg;   continue;
+        case 'b': manifest = optarg; continue;
+        case 'x': script = optarg;  continue;
+        case 'r': fleet = optarg;   continue;
+        case 'u': sync_csv = optarg; continue;
+        case 'g': bundle = optarg;  continue;
+        case 'j': njobs = atoi(optarg); if (njobs < 1) usage(); continue;
+        case 'e': nports = atoi(optarg); if (nports < 1) usage(); continue;
+        case 'm': timing = optarg;  continue;
+        case 'o': output_img = optarg;  continue;
+        case 'f': output_conf = optarg; continue;
+        case 'R': radio_rt_setup(atoi(optarg)); continue;
+        case 'J': radio_timeline_open(optarg); continue;
         default:
             usage();
         case EOF:
@@ -96,21 +158,104 @@ int main(int argc, char **argv)
     }
     argc -= optind;
     argv += optind;
-    if (write_flag + config_flag > 1) {
-        fprintf(stderr, "Only one of -w or -c options is allowed.\n");
+    if (write_flag + config_flag + (plan != 0) + (query != 0) + (nports != 0) +
+        (manifest != 0) + (fleet != 0) + (sync_csv != 0) + (bundle != 0) +
+        (script != 0) + health_flag > 1) {
+        fprintf(stderr, "Only one of -w, -c, -p, -q, -e, -b, -x, -g, -r, -u or -H options is allowed.\n");
         usage();
     }
-    setvbuf(stdout, 0, _IOLBF, 0);
+    if ((output_img && strcmp(output_img, "-") == 0) ||
+        (output_conf && strcmp(output_conf, "-") == 0)) {
+        if (output_img && output_conf && strcmp(output_img, output_conf) == 0) {
+            fprintf(stderr, "Image and configuration cannot go to the same output.\n");
+            exit(-1);
+        }
+        // Standard output is busy with data.
+        if (serial_verbose) {
+            fprintf(stderr, "Option -v cannot be used with output to '-'.\n");
+            exit(-1);
+        }
+        info = stderr;
+    } else {
+        setvbuf(stdout, 0, _IOLBF, 0);
+    }
     setvbuf(stderr, 0, _IOLBF, 0);
 
-    if (write_flag) {
+    if (health_flag) {
+        // Print health of ports.
+        if (argc != 0)
+            usage();
+
+        radio_health_report(stdout);
+
+    } else if (sync_csv) {
+        // Update channels by changes of repeater directory.
+        if (argc != 2)
+            usage();
+
+        radio_read_image(argv[1]);
+        radio_print_version(info);
+        radio_sync(info, sync_csv, argv[0]);
+        radio_save_image(output_img ? output_img : "device.img");
+
+    } else if (fleet) {
+        // Find radios out of date.
+        if (argc != 0)
+            usage();
+
+        radio_reconcile(fleet, output_img);
+
+    } else if (bundle) {
+        // Build images of the bundle.
+        if (argc != 0)
+            usage();
+
+        radio_bundle(bundle, output_img, njobs);
+
+    } else if (script) {
+        // Run commands against images in memory.
+        if (argc != 0)
+            usage();
+
+        radio_script(script);
+
+    } else if (manifest) {
+        // Run batch job.
+        if (argc != 0)
+            usage();
+
+        radio_batch(manifest);
+
+    } else if (nports) {
+        // Estimate session times and plan the station.
+        radio_estimate(nports, timing, argc, argv);
+
+    } else if (query) {
+        // Find channels in image files.
+        if (argc < 1)
+            usage();
+
+        radio_query(query, argc, argv);
+
+    } else if (plan) {
+        // Write golden image to device.
+        if (argc != 1)
+            usage();
+
+        radio_load_plan(plan);
+        radio_connect(argv[0], 0);
+        radio_print_version(info);
+        radio_upload(0);
+        radio_disconnect();
+
+    } else if (write_flag) {
         // Restore image file to device.
         if (argc != 2 || !type)
             usage();
 
         radio_connect(argv[0], type);
         radio_read_image(argv[1]);
-        radio_print_version(stdout);
+        radio_print_version(info);
         radio_upload(0);
         radio_disconnect();
 
@@ -118,24 +263,45 @@ int main(int argc, char **argv)
         if (argc != 2)
             usage();
 
+        if (strcmp(argv[0], "-") == 0 && strcmp(argv[1], "-") == 0) {
+            fprintf(stderr, "Image and configuration cannot both come from standard input.\n");
+            exit(-1);
+        }
         if (is_file(argv[0])) {
             // Apply text config to image file.
             radio_read_image(argv[0]);
-            radio_print_version(stdout);
-            radio_parse_config(argv[1]);
-            radio_save_image("device.img");
+            radio_print_version(info);
+            if (stable_flag)
+                radio_parse_config_stable(argv[1]);
+            else
+                radio_parse_config(argv[1]);
+            radio_save_image(output_img ? output_img : "device.img");
 
         } else {
+            int cont_flag = 1;
+
             if (!type)
                 usage();
 
             // Update device from text config file.
+            // Bad configuration fails before the radio is touched.
+            radio_preflight_config(type, argv[1]);
             radio_connect(argv[0], type);
-            radio_download();
-            radio_print_version(stdout);
-            radio_save_image("backup.img");
-            radio_parse_config(argv[1]);
-            radio_upload(1);
+            if (trust_name && radio_recall_image(trust_name)) {
+                // Radio is not in clone mode yet.
+                // Cached image is not a backup of the radio.
+                cont_flag = 0;
+                radio_print_version(info);
+            } else {
+                radio_download();
+                radio_print_version(info);
+                radio_save_image(output_img ? output_img : "backup.img");
+            }
+            if (stable_flag)
+                radio_parse_config_stable(argv[1]);
+            else
+                radio_parse_config(argv[1]);
+            radio_upload(cont_flag);
             radio_disconnect();
         }
 
@@ -147,8 +313,15 @@ int main(int argc, char **argv)
             // Print configuration from image file.
             // Load image from file.
             radio_read_image(argv[0]);
-            radio_print_version(stdout);
-            radio_print_config(stdout, ! isatty(1));
+            if (output_conf && strcmp(output_conf, "-") != 0) {
+                FILE *conf = file_create(output_conf);
+                radio_print_version(conf);
+                radio_print_config(conf, 1);
+                file_commit(conf);
+            } else {
+                radio_print_version(stdout);
+                radio_print_config(stdout, ! isatty(1));
+            }
 
         } else {
             if (!type)
@@ -157,21 +330,26 @@ int main(int argc, char **argv)
             // Dump device to image file.
             radio_connect(argv[0], type);
             radio_download();
-            radio_print_version(stdout);
+            radio_print_version(info);
             radio_disconnect();
-            radio_save_image("device.img");
+
+            // Image and text configuration are synced together.
+            file_batch_begin();
+            radio_save_image(output_img ? output_img : "device.img");
 
             // Print configuration to file.
-            const char *filename = "device.conf";
-            printf("Print configuration to file '%s'.\n", filename);
-            FILE *conf = fopen(filename, "w");
-            if (! conf) {
-                perror(filename);
-                exit(-1);
+            const char *filename = output_conf ? output_conf : "device.conf";
+            fprintf(info, "Print configuration to file '%s'.\n", filename);
+            if (strcmp(filename, "-") == 0) {
+                radio_print_version(stdout);
+                radio_print_config(stdout, 1);
+            } else {
+                FILE *conf = file_create(filename);
+                radio_print_version(conf);
+                radio_print_config(conf, 1);
+                file_commit(conf);
             }
-            radio_print_version(conf);
-            radio_print_config(conf, 1);
-            fclose(conf);
+            file_batch_commit();
         }
     }
     return 0;
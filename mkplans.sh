@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Generate C source with golden images, for option -p.
+# Each plan is built by applying a configuration to a base image.
+#
+# Usage: mkplans.sh yaesutool name=base.img:file.conf ...
+#
+tool=`cd \`dirname $1\` && pwd`/`basename $1`
+shift
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf $tmp' 0
+
+abspath()
+{
+    echo `cd \`dirname $1\` && pwd`/`basename $1`
+}
+
+echo "/* Generated by mkplans.sh, do not edit. */"
+echo "#include <stdio.h>"
+echo "#include \"radio.h\""
+n=0
+for plan in "$@"; do
+    name=`echo $plan | sed 's/=.*//'`
+    base=`echo $plan | sed 's/^[^=]*=//; s/:.*//'`
+    conf=`echo $plan | sed 's/^[^:]*://'`
+    base=`abspath $base` && conf=`abspath $conf` || exit 1
+    if ! (cd $tmp && $tool -c $base $conf >/dev/null 2>$tmp/log); then
+        cat $tmp/log >&2
+        echo "Plan $name: cannot build image." >&2
+        exit 1
+    fi
+    echo ""
+    echo "static const unsigned char plan$n[] = {"
+    od -An -v -tx1 $tmp/device.img | sed 's/ *\([0-9a-f][0-9a-f]\)/0x\1,/g'
+    echo "};"
+    n=`expr $n + 1`
+done
+echo ""
+echo "const radio_plan_t radio_plans[] = {"
+n=0
+for plan in "$@"; do
+    name=`echo $plan | sed 's/=.*//'`
+    echo "    { \"$name\", sizeof(plan$n), plan$n },"
+    n=`expr $n + 1`
+done
+echo "    { 0 }"
+echo "};"
@@ -31,15 +31,26 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <utime.h>
 #include <sys/stat.h>
 #include "radio.h"
 #include "util.h"
+#include "trace.h"
 
 int radio_port;                         // File descriptor of programming serial port
 unsigned char radio_mem [0x10000];      // Radio memory contents, up to 64kbytes
+unsigned radio_mem_epoch;               // Generation of memory contents
 int radio_progress;                     // Read/write progress counter
+unsigned char radio_ident [8];          // Fingerprint of the radio
 
 static radio_device_t *device;          // Device-dependent interface
+static const char *cache_name;          // Name of the radio for the image cache
+static int ident_region;                // Next region of the fingerprint
+static unsigned long long ident_hash;   // Hash of previous regions
+
+static void remember_image(void);
 
 //
 // Close the serial port.
@@ -50,9 +61,14 @@ void radio_disconnect()
 
     // Restore the port mode.
     serial_close(radio_port);
+    TRACE0(session_end);
+    radio_health_end();
 
     // Radio needs a timeout to reset to a normal state.
-    mdelay(2000);
+    radio_timeline_begin("reset wait", 0);
+    mdelay(RADIO_RESET_MSEC);
+    radio_timeline_end();
+    radio_timeline_end();
 }
 
 //
@@ -63,20 +79,137 @@ void radio_print_version(FILE *out)
     device->print_version(out);
 }
 
+//
+// Find device by type name: ft60, vx2.
+// Return 0 when unknown.
+//
+radio_device_t *radio_find_type(const char *radio_type)
+{
+    if (strcasecmp("ft60", radio_type) == 0)            // Yaesu FT-60R
+        return &radio_ft60;
+    if (strcasecmp("vx2", radio_type) == 0)             // Yaesu VX-2R, VX-2E
+        return &radio_vx2;
+    return 0;
+}
+
+//
+// Type name of the current device: ft60, vx2.
+//
+const char *radio_type()
+{
+    return (device == &radio_vx2) ? "vx2" : "ft60";
+}
+
+//
+// Device of the current image.
+//
+radio_device_t *radio_current_device()
+{
+    return device;
+}
+
+//
+// Make the device current, for the image copied into radio_mem.
+//
+void radio_select_device(radio_device_t *dev)
+{
+    device = dev;
+    radio_mem_epoch++;
+}
+
+//
+// Number of memory channels of the current device.
+//
+int radio_nchannels()
+{
+    return device->nchannels;
+}
+
 //
 // Connect to the radio and identify the type of device.
+// When type is null, use the device of the image already loaded.
 //
 void radio_connect(const char *port_name, const char *radio_type)
 {
-    if (strcasecmp("ft60", radio_type) == 0) {          // Yaesu FT-60R
-        device = &radio_ft60;
-    } else if (strcasecmp("vx2", radio_type) == 0) {    // Yaesu VX-2R, VX-2E
-        device = &radio_vx2;
+    if (radio_type) {
+        device = radio_find_type(radio_type);
+        if (! device) {
+            fprintf(stderr, "Unknown radio type: %s\n", radio_type);
+            exit(-1);
+        }
     }
 
-    printf("Radio: %s\n", device->name);
+    fprintf(stderr, "Radio: %s\n", device->name);
     fprintf(stderr, "Connect to %s at %d baud.\n", port_name, device->baud);
     radio_port = serial_open(port_name, device->baud);
+    TRACE2(session_start, port_name, device->baud);
+    radio_health_begin(port_name);
+    radio_timeline_process(port_name);
+    radio_timeline_begin("session", device->name);
+}
+
+//
+// Add block of memory to the fingerprint, as it comes from the radio.
+// Only the part of block in the stable regions is hashed.
+//
+void radio_fingerprint_block(int start, const unsigned char *data, int nbytes)
+{
+    const radio_region_t *r;
+    int i, from, to;
+
+    if (start == 0) {
+        ident_region = 0;
+        ident_hash = 0;
+    }
+    for (;;) {
+        r = &device->fingerprint[ident_region];
+        if (r->nbytes == 0)
+            return;
+
+        from = (r->start > start) ? r->start : start;
+        to = r->start + r->nbytes;
+        if (to > start + nbytes)
+            to = start + nbytes;
+        if (from < to)
+            ident_hash = hash_bytes(data + from - start, to - from, ident_hash);
+        if (to < r->start + r->nbytes)
+            return;
+
+        // Region complete.
+        ident_region++;
+        if (r[1].nbytes == 0) {
+            for (i=0; i<8; i++)
+                radio_ident[i] = ident_hash >> (56 - i*8);
+        }
+    }
+}
+
+//
+// Print fingerprint of the radio.
+//
+static void print_ident(FILE *out)
+{
+    int i;
+
+    fprintf(out, "Fingerprint: ");
+    for (i=0; i<8; i++)
+        fprintf(out, "%02x", radio_ident[i]);
+    fprintf(out, "\n");
+}
+
+//
+// Sessions of the clone protocol, run on the I/O thread.
+//
+static void download_session(int arg)
+{
+    device->download();
+    radio_timeline_phase(0);
+}
+
+static void upload_session(int cont_flag)
+{
+    device->upload(cont_flag);
+    radio_timeline_phase(0);
 }
 
 //
@@ -88,10 +221,15 @@ void radio_download()
     if (! serial_verbose)
         fprintf(stderr, "Read device: ");
 
-    device->download();
+    radio_timeline_begin("download", 0);
+    radio_rt_run(download_session, 0);
+    radio_timeline_end();
+    radio_mem_epoch++;
 
     if (! serial_verbose)
         fprintf(stderr, " done.\n");
+    print_ident(stderr);
+    remember_image();
 }
 
 //
@@ -109,86 +247,775 @@ void radio_upload(int cont_flag)
         fprintf(stderr, "Write device: ");
 
     serial_flush(radio_port);
-    device->upload(cont_flag);
+    radio_timeline_begin("upload", 0);
+    radio_rt_run(upload_session, cont_flag);
+    radio_timeline_end();
 
     if (! serial_verbose)
         fprintf(stderr, " done.\n");
+    remember_image();
+}
+
+//
+// Guess device type by image size.
+// Return 0 when unknown.
+//
+static radio_device_t *device_by_size(int size)
+{
+    switch (size) {
+    case 28616:
+    case 28617:
+    case 31435:
+        return &radio_ft60;
+    case 32595:
+        return &radio_vx2;
+    }
+    return 0;
+}
+
+//
+// Golden images: none unless linked from plans.o.
+//
+__attribute__((weak))
+const radio_plan_t radio_plans[] = { { 0 } };
+
+//
+// Load firmware image from the golden image linked into the binary.
+//
+void radio_load_plan(const char *name)
+{
+    const radio_plan_t *p;
+
+    for (p=radio_plans; p->name; p++) {
+        if (strcasecmp(p->name, name) == 0)
+            break;
+    }
+    if (! p->name) {
+        fprintf(stderr, "Unknown plan: %s\n", name);
+        exit(-1);
+    }
+    device = device_by_size(p->size);
+    if (! device) {
+        fprintf(stderr, "Plan %s: Unrecognized image size %u bytes.\n",
+            name, p->size);
+        exit(-1);
+    }
+    memcpy(radio_mem, p->data, p->size);
+    radio_mem_epoch++;
+    radio_fingerprint_block(0, radio_mem, p->size);
+}
+
+//
+// Print names of golden images.
+//
+void radio_print_plans(FILE *out)
+{
+    const radio_plan_t *p;
+
+    for (p=radio_plans; p->name; p++) {
+        radio_device_t *d = device_by_size(p->size);
+        fprintf(out, "                 %-6s - %s\n", p->name, d ? d->name : "???");
+    }
+}
+
+//
+// Open a stream for reading from memory.
+//
+static FILE *open_memory(void *data, int nbytes)
+{
+#ifdef MINGW32
+    FILE *f = tmpfile();
+
+    if (f) {
+        fwrite(data, 1, nbytes, f);
+        rewind(f);
+    }
+    return f;
+#else
+    return fmemopen(data, nbytes, "rb");
+#endif
 }
 
 //
 // Read firmware image from the binary file.
+// File name "-" means standard input.
 //
 void radio_read_image(char *filename)
 {
+    static unsigned char data [sizeof(radio_mem) + 1];
+    static radio_device_t *const devices[] = { &radio_ft60, &radio_vx2, 0 };
+    radio_device_t *const *d;
     FILE *img;
-    struct stat st;
+    int nbytes;
 
     fprintf(stderr, "Read image from file '%s'.\n", filename);
-
-    // Guess device type by file size.
-    if (stat(filename, &st) < 0) {
-        perror(filename);
+    radio_timeline_begin("read image", filename);
+    if (strcmp(filename, "-") == 0) {
+        img = stdin;
+    } else {
+        img = fopen(filename, "rb");
+        if (! img) {
+            perror(filename);
+            exit(-1);
+        }
+    }
+    nbytes = fread(data, 1, sizeof(data), img);
+    if (img != stdin)
+        fclose(img);
+    if (nbytes > sizeof(radio_mem)) {
+        fprintf(stderr, "%s: File too large.\n", filename);
         exit(-1);
     }
-    switch (st.st_size) {
-    case 28616:
-    case 28617:
-    case 31435:
-        device = &radio_ft60;
-        break;
-    case 32595:
-        device = &radio_vx2;
-        break;
-    default:
-        fprintf(stderr, "%s: Unrecognized file size %u bytes.\n",
-            filename, (int) st.st_size);
+
+    // Identify device by magic at the start of image,
+    // or guess by size when the ident is not recognized.
+    memcpy(radio_mem, data, nbytes);
+    device = 0;
+    for (d=devices; *d; d++) {
+        if ((*d)->is_compatible()) {
+            device = *d;
+            break;
+        }
+    }
+    if (! device)
+        device = device_by_size(nbytes);
+    if (! device) {
+        fprintf(stderr, "%s: Unrecognized image, %u bytes.\n",
+            filename, nbytes);
         exit(-1);
     }
 
-    img = fopen(filename, "rb");
+    // Contents are loaded by the driver.
+    memset(radio_mem, 0, nbytes);
+    img = open_memory(data, nbytes);
     if (! img) {
         perror(filename);
         exit(-1);
     }
     device->read_image(img);
     fclose(img);
+    radio_mem_epoch++;
+    radio_fingerprint_block(0, radio_mem, nbytes);
+    radio_timeline_end();
+}
+
+//
+// Undo journal of the transaction: ranges of the image with
+// original contents.  Every byte is saved only once, at the first write.
+//
+typedef struct {
+    unsigned offset;                    // Start in radio_mem
+    unsigned nbytes;                    // Length of range
+} journal_t;
+
+static int journal_active;              // Transaction is open
+static journal_t *journal;              // Ranges, in order of writes
+static int journal_count, journal_max;
+static unsigned char *journal_data;     // Original bytes of ranges
+static int journal_size, journal_max_size;
+static unsigned char journal_saved [sizeof(radio_mem) / 8];
+
+//
+// Start a transaction on the image.
+//
+void radio_begin()
+{
+    journal_count = 0;
+    journal_size = 0;
+    journal_active = 1;
+}
+
+//
+// Forget the journal.
+//
+static void journal_clear()
+{
+    int i, a;
+
+    for (i=0; i<journal_count; i++) {
+        for (a=journal[i].offset; a<journal[i].offset + journal[i].nbytes; a++)
+            journal_saved[a / 8] &= ~(1 << (a % 8));
+    }
+    journal_count = 0;
+    journal_size = 0;
+    journal_active = 0;
+}
+
+//
+// Keep the changes of the transaction.
+//
+void radio_commit()
+{
+    journal_clear();
+}
+
+//
+// Undo the changes of the transaction.
+//
+void radio_rollback()
+{
+    int i, pos = journal_size;
+
+    for (i=journal_count-1; i>=0; i--) {
+        pos -= journal[i].nbytes;
+        memcpy(&radio_mem[journal[i].offset], &journal_data[pos], journal[i].nbytes);
+    }
+    journal_clear();
+    radio_mem_epoch++;
+}
+
+//
+// Append the range to the journal.
+//
+static void journal_append(int offset, int nbytes)
+{
+    journal_t *last = journal_count ? &journal[journal_count-1] : 0;
+    int a;
+
+    if (journal_size + nbytes > journal_max_size) {
+        journal_max_size = (journal_max_size + nbytes) * 2;
+        journal_data = realloc(journal_data, journal_max_size);
+        if (! journal_data) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(-1);
+        }
+    }
+    memcpy(&journal_data[journal_size], &radio_mem[offset], nbytes);
+    journal_size += nbytes;
+    for (a=offset; a<offset+nbytes; a++)
+        journal_saved[a / 8] |= 1 << (a % 8);
+
+    if (last && last->offset + last->nbytes == offset) {
+        // Extend the previous range.
+        last->nbytes += nbytes;
+        return;
+    }
+    if (journal_count >= journal_max) {
+        journal_max = journal_max ? journal_max * 2 : 256;
+        journal = realloc(journal, journal_max * sizeof(journal_t));
+        if (! journal) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(-1);
+        }
+    }
+    journal[journal_count].offset = offset;
+    journal[journal_count].nbytes = nbytes;
+    journal_count++;
+}
+
+//
+// Save the original bytes of the image before writing them:
+// only the runs which are not saved yet.
+//
+void radio_journal(const void *addr, int nbytes)
+{
+    int offset = (const unsigned char*) addr - radio_mem;
+    int i, n;
+
+    if (! journal_active)
+        return;
+    for (i=0; i<nbytes; i+=n) {
+        n = 1;
+        if (journal_saved[(offset+i) / 8] & (1 << ((offset+i) % 8)))
+            continue;
+        while (i+n < nbytes &&
+               ! (journal_saved[(offset+i+n) / 8] & (1 << ((offset+i+n) % 8))))
+            n++;
+        journal_append(offset + i, n);
+    }
+}
+
+//
+// Fill bytes of the image, with journal.
+//
+void radio_memset(void *addr, int c, int nbytes)
+{
+    radio_journal(addr, nbytes);
+    memset(addr, c, nbytes);
+}
+
+//
+// Mark slot as used or free.
+//
+void radio_slots_set(radio_slots_t *map, int i, int used)
+{
+    unsigned long long bit = 1ULL << (i % 64);
+
+    map->word[i / 64] = (map->word[i / 64] & ~bit) | (used ? bit : 0);
+}
+
+//
+// Find next used slot, starting from i: skip empty words,
+// then take the lowest set bit.
+//
+int radio_slots_next(const radio_slots_t *map, int i, int nslots)
+{
+    int w = i / 64;
+    unsigned long long bits;
+
+    if (i >= nslots)
+        return nslots;
+    bits = map->word[w] & (~0ULL << (i % 64));
+    while (! bits) {
+        if (++w >= (nslots + 63) / 64)
+            return nslots;
+        bits = map->word[w];
+    }
+    i = w*64 + __builtin_ctzll(bits);
+    return (i < nslots) ? i : nslots;
 }
 
 //
 // Save firmware image to the binary file.
+// File name "-" means standard output.
 //
 void radio_save_image(char *filename)
 {
     FILE *img;
 
     fprintf(stderr, "Write image to file '%s'.\n", filename);
-    img = fopen(filename, "w");
-    if (! img) {
-        perror(filename);
-        exit(-1);
+    radio_timeline_begin("save image", filename);
+    if (strcmp(filename, "-") == 0) {
+        device->save_image(stdout);
+        fflush(stdout);
+    } else {
+        img = file_create(filename);
+        device->save_image(img);
+        file_commit(img);
+    }
+    radio_timeline_end();
+}
+
+//
+// State of configuration parsing, shared by all fragments.
+//
+#define MAX_NESTING     8               // Depth limit for Include and Overlay
+
+static char table_erased [128];         // Table was cleared by its first row
+static int parse_quiet;                 // Compile without messages and cache
+
+//
+// Configuration compiled before connecting to the radio:
+// bits set by the configuration, independent of the image.
+//
+static struct {
+    char *name;                         // File name of configuration
+    char *text;                         // Contents of the file
+    unsigned char *mask;                // Bits written by the configuration
+    unsigned char *data;                // Values of these bits
+    char erased [sizeof(table_erased)]; // Tables cleared by the configuration
+    int exact;                          // Patch reproduces the parser
+} compiled;
+
+//
+// Read the whole file into memory, terminated by zero byte.
+//
+static char *load_file(const char *filename, int *nbytes)
+{
+    FILE *f;
+    char *data = 0;
+    int len = 0, n;
+
+    if (strcmp(filename, "-") == 0) {
+        f = stdin;
+    } else {
+        f = fopen(filename, "rb");
+        if (! f) {
+            perror(filename);
+            exit(-1);
+        }
     }
+    for (;;) {
+        data = realloc(data, len + 4096 + 1);
+        if (! data) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(-1);
+        }
+        n = fread(data + len, 1, 4096, f);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    if (f != stdin)
+        fclose(f);
+    data[len] = 0;
+    *nbytes = len;
+    return data;
+}
+
+//
+// Does this text contain Include or Overlay directives?
+//
+static int have_directives(const char *data)
+{
+    const char *p;
+
+    for (p=data; *p; p++) {
+        if (p == data || p[-1] == '\n') {
+            if (strncasecmp(p, "Include", 7) == 0 ||
+                strncasecmp(p, "Overlay", 7) == 0)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+//
+// Get the directory for compiled configuration fragments,
+// cached images and the health store.
+// Return 0 when caching is not possible.
+//
+const char *radio_cache_dir()
+{
+    static char path [1024];
+    const char *env = getenv("YAESUTOOL_CACHE");
+    const char *home = getenv("HOME");
+
+    if (path[0])
+        return path;
+    if (env && *env) {
+        snprintf(path, sizeof(path), "%s", env);
+    } else if (home && *home) {
+        snprintf(path, sizeof(path), "%s/.cache", home);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/.cache/yaesutool", home);
+    } else
+        return 0;
+
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        path[0] = 0;
+        return 0;
+    }
+    return path;
+}
+
+//
+// Path of the last known image of the named radio, in the cache.
+// Return 0 when caching is not possible.
+//
+static char *last_image_path()
+{
+    static char path [1100];
+    unsigned long long key;
+
+    if (! cache_name || ! radio_cache_dir())
+        return 0;
+    key = hash_bytes(cache_name, strlen(cache_name), 0);
+    key = hash_bytes(device->name, strlen(device->name), key);
+    snprintf(path, sizeof(path), "%s/radio-%016llx.img", radio_cache_dir(), key);
+    return path;
+}
+
+//
+// Save the image after download or upload: this is
+// the contents of the named radio now.
+//
+static void remember_image()
+{
+    char *path = last_image_path();
+    FILE *img;
+
+    if (! path)
+        return;
+    img = file_create(path);
     device->save_image(img);
-    fclose(img);
+    file_commit(img);
 }
 
 //
-// Read the configuration from text file, and modify the firmware.
+// Load the last known image of the named radio from the cache,
+// instead of downloading it.  Return 0 when not found: then
+// the image of this session is remembered under the name.
 //
-void radio_parse_config(char *filename)
+int radio_recall_image(const char *name)
+{
+    char *path;
+    radio_device_t *dev = device;
+
+    cache_name = name;
+    path = last_image_path();
+    if (! path || access(path, R_OK) != 0) {
+        fprintf(stderr, "No cached image of radio %s.\n", name);
+        return 0;
+    }
+    radio_read_image(path);
+    if (device != dev) {
+        fprintf(stderr, "%s: Cached image is not for %s.\n", path, dev->name);
+        exit(-1);
+    }
+    return 1;
+}
+
+//
+// Compiled patches kept in the cache.  The key includes a hash of
+// the whole image, so every base image adds files: the least recently
+// used ones are removed above this number.
+//
+#define MAX_PATCHES     256
+
+typedef struct {
+    char name [64];
+    time_t mtime;
+} patch_file_t;
+
+static int compare_mtime(const void *a, const void *b)
+{
+    const patch_file_t *x = a, *y = b;
+
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+//
+// Remove the least recently used patches above MAX_PATCHES.
+// Patches are touched when applied, so mtime gives the last use.
+//
+static void prune_patches()
+{
+    const char *dir = radio_cache_dir();
+    patch_file_t *list = 0;
+    char path [1100];
+    struct dirent *de;
+    struct stat st;
+    int n = 0, len, i;
+    DIR *d;
+
+    d = opendir(dir);
+    if (! d)
+        return;
+    while ((de = readdir(d)) != 0) {
+        len = strlen(de->d_name);
+        if (len < 7 || len >= sizeof(list->name) ||
+            strcmp(de->d_name + len - 6, ".patch") != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) < 0)
+            continue;
+        if (n % 256 == 0) {
+            list = realloc(list, (n + 256) * sizeof(patch_file_t));
+            if (! list) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(-1);
+            }
+        }
+        strcpy(list[n].name, de->d_name);
+        list[n].mtime = st.st_mtime;
+        n++;
+    }
+    closedir(d);
+
+    if (n > MAX_PATCHES) {
+        qsort(list, n, sizeof(patch_file_t), compare_mtime);
+        for (i=0; i<n-MAX_PATCHES; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, list[i].name);
+            unlink(path);
+        }
+    }
+    free(list);
+}
+
+//
+// Apply the compiled fragment from the cache.
+// Patch format: magic, table_erased[] state, then a list
+// of records (offset, length, new bytes), then the trailer:
+// end marker, number of records and hash of all previous bytes
+// after the magic.  Return 0 when not found or damaged:
+// then the image and the state of tables are not changed.
+//
+#define PATCH_END       0xffffffff      // Offset of the trailer record
+
+static int apply_cached_patch(const char *path)
+{
+    unsigned char *buf, erased [sizeof(table_erased)];
+    unsigned long long hash, saved_hash;
+    unsigned rec[2], nrecords = 0;
+    char magic [8];
+    FILE *f;
+    int i, k;
+
+    f = fopen(path, "rb");
+    if (! f)
+        return 0;
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, "YTPATCH2", 8) != 0 ||
+        fread(erased, 1, sizeof(erased), f) != sizeof(erased)) {
+        fclose(f);
+        return 0;
+    }
+    hash = hash_bytes(erased, sizeof(erased), 0);
+
+    // Stage records in a copy, so a damaged patch leaves the image intact.
+    buf = malloc(sizeof(radio_mem));
+    if (! buf) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    memcpy(buf, radio_mem, sizeof(radio_mem));
+    for (;;) {
+        if (fread(rec, sizeof(rec[0]), 2, f) != 2)
+            goto damaged;
+        if (rec[0] == PATCH_END)
+            break;
+        if (rec[0] > sizeof(radio_mem) || rec[1] > sizeof(radio_mem) - rec[0] ||
+            fread(&buf[rec[0]], 1, rec[1], f) != rec[1])
+            goto damaged;
+        hash = hash_bytes(rec, sizeof(rec), hash);
+        hash = hash_bytes(&buf[rec[0]], rec[1], hash);
+        nrecords++;
+    }
+    if (rec[1] != nrecords ||
+        fread(&saved_hash, sizeof(saved_hash), 1, f) != 1 ||
+        saved_hash != hash || fgetc(f) != EOF)
+        goto damaged;
+    fclose(f);
+
+    // Whole patch is good: journal the changed bytes and apply.
+    for (i=0; i<sizeof(radio_mem); i=k) {
+        for (k=i; k<sizeof(radio_mem) && buf[k] != radio_mem[k]; k++)
+            continue;
+        if (k > i)
+            radio_journal(&radio_mem[i], k - i);
+        else
+            k++;
+    }
+    memcpy(radio_mem, buf, sizeof(radio_mem));
+    memcpy(table_erased, erased, sizeof(table_erased));
+    radio_mem_epoch++;
+    free(buf);
+
+    // Mark as recently used.
+    utime(path, 0);
+    return 1;
+
+damaged:
+    free(buf);
+    fclose(f);
+    return 0;
+}
+
+//
+// Save the changes made by the fragment as a compiled patch.
+// The cache can be rebuilt, so it is not synced to disk.
+//
+static void save_patch(const char *path, const unsigned char *before)
+{
+    unsigned long long hash;
+    unsigned rec[2], nrecords = 0;
+    FILE *f;
+    int i, k;
+
+    f = file_create(path);
+    fwrite("YTPATCH2", 1, 8, f);
+    fwrite(table_erased, 1, sizeof(table_erased), f);
+    hash = hash_bytes(table_erased, sizeof(table_erased), 0);
+    for (i=0; i<sizeof(radio_mem); i++) {
+        if (before[i] == radio_mem[i])
+            continue;
+
+        // Merge changes separated by less than 8 equal bytes.
+        for (k=i+1; k<sizeof(radio_mem); k++) {
+            int n = sizeof(radio_mem) - k;
+            if (n > 8)
+                n = 8;
+            if (memcmp(&before[k], &radio_mem[k], n) == 0)
+                break;
+        }
+        rec[0] = i;
+        rec[1] = k - i;
+        fwrite(rec, sizeof(rec[0]), 2, f);
+        fwrite(&radio_mem[i], 1, k - i, f);
+        hash = hash_bytes(rec, sizeof(rec), hash);
+        hash = hash_bytes(&radio_mem[i], k - i, hash);
+        nrecords++;
+        i = k;
+    }
+
+    // Trailer: a patch cut at a record boundary is rejected.
+    rec[0] = PATCH_END;
+    rec[1] = nrecords;
+    fwrite(rec, sizeof(rec[0]), 2, f);
+    fwrite(&hash, sizeof(hash), 1, f);
+    file_commit_fast(f);
+    prune_patches();
+}
+
+//
+// Get a path of the file, relative to the directory of another file.
+//
+static char *relative_path(const char *base, const char *name)
+{
+    const char *slash = strrchr(base, '/');
+    int dirlen = (*name == '/' || ! slash) ? 0 : slash - base + 1;
+    char *path = malloc(dirlen + strlen(name) + 1);
+
+    if (! path) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    memcpy(path, base, dirlen);
+    strcpy(path + dirlen, name);
+    return path;
+}
+
+//
+// Parse one configuration file.
+// Parameters 'Include: file' and 'Overlay: file' insert another
+// fragment: Include at this point, Overlay after the end of the
+// current file.  Later rows override earlier channels, banks and
+// settings: a table is cleared only by its first row in the whole
+// composition.
+//
+static void parse_fragment(const char *filename, int depth, char *text)
 {
-    FILE *conf;
+    char *data, *next, *eol, **overlay = 0;
     char line [256], *p, *v;
-    int table_id = 0, table_dirty = 0;
+    char table_started [sizeof(table_erased)];
+    unsigned char *before = 0;
+    char cache_path [1100];
+    int table_id = 0, nbytes, noverlays = 0, i;
 
-    fprintf(stderr, "Read configuration from file '%s'.\n", filename);
-    conf = fopen(filename, "r");
-    if (! conf) {
-        perror(filename);
+    if (depth > MAX_NESTING) {
+        fprintf(stderr, "%s: Too deep nesting of includes.\n", filename);
         exit(-1);
     }
+    if (text) {
+        data = text;
+        nbytes = strlen(text);
+    } else
+        data = load_file(filename, &nbytes);
+    cache_path[0] = 0;
 
-    while (fgets(line, sizeof(line), conf)) {
-        line[sizeof(line)-1] = 0;
+    if (depth > 0 && ! parse_quiet && ! have_directives(data) && radio_cache_dir()) {
+        // Compiled patch depends on the text, the image it applies to,
+        // and the state of tables.
+        unsigned long long key = hash_bytes(data, nbytes, 0);
+        key = hash_bytes(radio_mem, sizeof(radio_mem), key);
+        key = hash_bytes(table_erased, sizeof(table_erased), key);
+        snprintf(cache_path, sizeof(cache_path), "%s/%016llx.patch", radio_cache_dir(), key);
+
+        if (apply_cached_patch(cache_path)) {
+            fprintf(stderr, "Apply compiled configuration from file '%s'.\n", filename);
+            free(data);
+            return;
+        }
+        before = malloc(sizeof(radio_mem));
+        if (! before) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(-1);
+        }
+        memcpy(before, radio_mem, sizeof(radio_mem));
+    }
+    if (! parse_quiet)
+        fprintf(stderr, "Read configuration from file '%s'.\n", filename);
+
+    memset(table_started, 0, sizeof(table_started));
+    for (next=data; *next; next=eol) {
+        // Get next line.
+        eol = strchr(next, '\n');
+        eol = eol ? eol+1 : next + strlen(next);
+        i = eol - next;
+        if (i > sizeof(line) - 1)
+            i = sizeof(line) - 1;
+        memcpy(line, next, i);
+        line[i] = 0;
 
         // Strip comments.
         v = strchr(line, '#');
@@ -214,11 +1041,10 @@ void radio_parse_config(char *filename)
             if (! v) {
                 // Table header: get table type.
                 table_id = device->parse_header(p);
-                if (! table_id) {
-badline:            fprintf(stderr, "Invalid line: '%s'\n", line);
+                if (! table_id || table_id >= sizeof(table_erased)) {
+badline:            fprintf(stderr, "%s: Invalid line: '%s'\n", filename, line);
                     exit(-1);
                 }
-                table_dirty = 0;
                 continue;
             }
 
@@ -229,7 +1055,23 @@ badline:            fprintf(stderr, "Invalid line: '%s'\n", line);
             while (*v == ' ' || *v == '\t')
                 v++;
 
-            device->parse_parameter(p, v);
+            if (strcasecmp("Include", p) == 0) {
+                char *path = relative_path(filename, v);
+                radio_timeline_begin("include", path);
+                parse_fragment(path, depth + 1, 0);
+                radio_timeline_end();
+                free(path);
+
+            } else if (strcasecmp("Overlay", p) == 0) {
+                overlay = realloc(overlay, (noverlays + 1) * sizeof(char*));
+                if (! overlay) {
+                    fprintf(stderr, "Out of memory.\n");
+                    exit(-1);
+                }
+                overlay[noverlays++] = relative_path(filename, v);
+
+            } else
+                device->parse_parameter(p, v);
 
         } else {
             // Table row or comment.
@@ -243,13 +1085,675 @@ badline:            fprintf(stderr, "Invalid line: '%s'\n", line);
                 goto badline;
             }
 
-            if (! device->parse_row(table_id, ! table_dirty, p)) {
+            int first_row = ! table_erased[table_id]  ? ROW_FIRST :
+                            ! table_started[table_id] ? ROW_FRAGMENT :
+                                                        ROW_NEXT;
+            if (! device->parse_row(table_id, first_row, p)) {
                 goto badline;
             }
-            table_dirty = 1;
+            TRACE2(conf_row, table_id, first_row);
+            table_erased[table_id] = 1;
+            table_started[table_id] = 1;
         }
     }
-    fclose(conf);
+    free(data);
+
+    if (before) {
+        save_patch(cache_path, before);
+        free(before);
+    }
+
+    // Apply overlays on top of this file.
+    for (i=0; i<noverlays; i++) {
+        radio_timeline_begin("overlay", overlay[i]);
+        parse_fragment(overlay[i], depth + 1, 0);
+        radio_timeline_end();
+        free(overlay[i]);
+    }
+    free(overlay);
+}
+
+//
+// Read the configuration from text file, and modify the firmware.
+// When the file was compiled by radio_preflight_config(), apply the patch.
+//
+void radio_parse_config(char *filename)
+{
+    int i;
+
+    memset(table_erased, 0, sizeof(table_erased));
+    radio_timeline_begin("apply config", filename);
+    if (! compiled.name || strcmp(filename, compiled.name) != 0) {
+        parse_fragment(filename, 0, 0);
+
+    } else if (! compiled.exact) {
+        // Configuration depends on the image: parse it again.
+        parse_fragment(filename, 0, strdup(compiled.text));
+
+    } else {
+        fprintf(stderr, "Apply compiled configuration from file '%s'.\n", filename);
+        for (i=0; i<sizeof(radio_mem); i++) {
+            if (compiled.mask[i]) {
+                radio_journal(&radio_mem[i], 1);
+                radio_mem[i] = (radio_mem[i] & ~compiled.mask[i]) | compiled.data[i];
+            }
+        }
+        memcpy(table_erased, compiled.erased, sizeof(table_erased));
+        radio_mem_epoch++;
+    }
+    radio_timeline_end();
+}
+
+//
+// Fill the image for a check of the patch: random bytes, or random
+// choice of all zeros and all ones per byte, which looks like empty
+// records and flags of real images.
+//
+static void fill_check_image(int n, int size)
+{
+    unsigned seed = 12345 + n * 7919;
+    int i;
+
+    for (i=0; i<size; i++) {
+        seed = seed * 1103515245 + 12345;
+        radio_mem[i] = (n & 1) ? -(seed >> 31) : seed >> 16;
+    }
+}
+
+//
+// Apply the configuration to the image in memory by the parser,
+// and compare with the result of the patch.
+// Return 1 when they are equal.
+//
+static int check_patch(char *filename, unsigned char *result)
+{
+    int i;
+
+    memcpy(result, radio_mem, sizeof(radio_mem));
+    radio_mem_epoch++;
+    memset(table_erased, 0, sizeof(table_erased));
+    parse_fragment(filename, 0, strdup(compiled.text));
+    for (i=0; i<sizeof(radio_mem); i++) {
+        if (((result[i] & ~compiled.mask[i]) | compiled.data[i]) != radio_mem[i])
+            return 0;
+    }
+    return 1;
+}
+
+#define NCHECKS 6                       // Random images to check the patch
+
+//
+// Parse the configuration for the radio type before connecting to it,
+// so bad input fails before the download.  The configuration is applied
+// to blank images of all zeros and all ones: bits equal in both results
+// are written by the configuration.  Several random images and golden
+// images of this radio check that the patch gives the same result
+// as the parser; otherwise the configuration is parsed again.
+//
+void radio_preflight_config(const char *radio_type, char *filename)
+{
+    static unsigned char save [sizeof(radio_mem)], result [sizeof(radio_mem)];
+    radio_device_t *dev = radio_find_type(radio_type);
+    const radio_plan_t *p;
+    int nbytes, pass, i;
+
+    if (! dev) {
+        fprintf(stderr, "Unknown radio type: %s\n", radio_type);
+        exit(-1);
+    }
+    device = dev;
+    radio_timeline_begin("preflight config", filename);
+    compiled.name = filename;
+    compiled.text = load_file(filename, &nbytes);
+    compiled.mask = malloc(sizeof(radio_mem));
+    compiled.data = malloc(sizeof(radio_mem));
+    if (! compiled.mask || ! compiled.data) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    memcpy(save, radio_mem, sizeof(radio_mem));
+
+    for (pass=0; pass<2; pass++) {
+        memset(radio_mem, pass ? 0xff : 0, sizeof(radio_mem));
+        radio_mem_epoch++;
+        memset(table_erased, 0, sizeof(table_erased));
+        parse_fragment(filename, 0, strdup(compiled.text));
+        if (pass == 0) {
+            memcpy(result, radio_mem, sizeof(radio_mem));
+            memcpy(compiled.erased, table_erased, sizeof(table_erased));
+            parse_quiet = 1;
+        }
+    }
+    for (i=0; i<sizeof(radio_mem); i++) {
+        compiled.mask[i] = ~(result[i] ^ radio_mem[i]);
+        compiled.data[i] = result[i] & compiled.mask[i];
+    }
+
+    // Check the patch on random and golden images.
+    compiled.exact = 1;
+    for (i=0; i<NCHECKS && compiled.exact; i++) {
+        fill_check_image(i, sizeof(radio_mem));
+        compiled.exact = check_patch(filename, result);
+    }
+    for (p=radio_plans; p->name && compiled.exact; p++) {
+        if (device_by_size(p->size) != dev)
+            continue;
+        memset(radio_mem, 0, sizeof(radio_mem));
+        memcpy(radio_mem, p->data, p->size);
+        compiled.exact = check_patch(filename, result);
+    }
+    parse_quiet = 0;
+
+    memcpy(radio_mem, save, sizeof(radio_mem));
+    radio_mem_epoch++;
+    radio_timeline_end();
+}
+
+//
+// Read the configuration from text in memory, and modify the firmware.
+// Includes are relative to the name.  The text is freed.
+//
+void radio_parse_text(const char *name, char *text)
+{
+    memset(table_erased, 0, sizeof(table_erased));
+    parse_fragment(name, 0, text);
+}
+
+//
+// Apply rows of configuration text on top of the current image:
+// tables are not erased.  The text stays with the caller.
+//
+void radio_parse_rows(const char *name, const char *text)
+{
+    char *copy = strdup(text);
+
+    if (! copy) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    memset(table_erased, 1, sizeof(table_erased));
+    parse_fragment(name, 0, copy);
+}
+
+//
+// Rows of channel and bank tables, rendered from the image.
+// Row text after the number is a canonical form of the contents.
+//
+typedef struct {
+    char *chan[1000+1];                 // Channel rows, by number
+    char *bank[100+1];                  // Bank rows, by number
+    char *chan_header;                  // Header of channel table
+} rendered_t;
+
+static int chan_table, bank_table;      // Table ids of channels and banks
+
+static void render_tables(rendered_t *r, int nchannels)
+{
+    char *text = 0, *line, *next;
+    size_t size = 0;
+    FILE *out;
+    int table_id = 0, n;
+
+    memset(r, 0, sizeof(*r));
+    out = open_memstream(&text, &size);
+    if (! out) {
+        perror("open_memstream");
+        exit(-1);
+    }
+    device->print_config(out, 0);
+    fclose(out);
+
+    for (line=text; *line; line=next) {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = 0;
+        else
+            next = line + strlen(line);
+
+        if (*line != ' ') {
+            table_id = (*line && ! strchr(line, ':')) ? device->parse_header(line) : 0;
+            if (table_id == chan_table && ! r->chan_header)
+                r->chan_header = strdup(line);
+            continue;
+        }
+        n = strtol(line, &line, 10);
+        if (table_id == chan_table && n >= 1 && n <= nchannels)
+            r->chan[n] = strdup(line);
+        else if (table_id == bank_table && n >= 1 && n <= 100)
+            r->bank[n] = strdup(line);
+    }
+    free(text);
+}
+
+static void free_tables(rendered_t *r)
+{
+    int n;
+
+    for (n=0; n<=1000; n++)
+        free(r->chan[n]);
+    for (n=0; n<=100; n++)
+        free(r->bank[n]);
+    free(r->chan_header);
+}
+
+//
+// Print bank row, with members renumbered by the slot map.
+// Order of members is kept.
+//
+static void print_mapped_bank(FILE *out, int bank, const char *list, const int *slot)
+{
+    int last = -1, range = 0, first = 1, a, b, cnum;
+    const char *p = list;
+
+    fprintf(out, "%4d    ", bank);
+    for (;;) {
+        while (*p == ' ' || *p == ',')
+            p++;
+        if (*p < '0' || *p > '9')
+            break;
+        a = b = strtol(p, (char**)&p, 10);
+        if (*p == '-')
+            b = strtol(p+1, (char**)&p, 10);
+        for (; a<=b; a++) {
+            cnum = slot[a] ? slot[a] : a;
+            if (cnum == last+1) {
+                range = 1;
+            } else {
+                if (range) {
+                    fprintf(out, "-%d", last);
+                    range = 0;
+                }
+                if (! first)
+                    fprintf(out, ",");
+                fprintf(out, "%d", cnum);
+                first = 0;
+            }
+            last = cnum;
+        }
+    }
+    if (range)
+        fprintf(out, "-%d", last);
+    if (first)
+        fprintf(out, "-");
+    fprintf(out, "\n");
+}
+
+//
+// Read the configuration, keeping channels of the current image
+// in their memory slots.
+// The configuration is applied as usual, then its channels are mapped
+// onto the slots of the original image: a channel with the same
+// contents stays in its slot, new channels fill the slots of removed
+// ones and the empty slots.  Banks are renumbered accordingly.
+//
+void radio_parse_config_stable(char *filename)
+{
+    static rendered_t old, new;
+    static int slot [1000+1], chan_at [1000+1];
+    static char taken [1000+1];
+    int nchannels = device->nchannels, n, s, pass;
+    char *text = 0, header [16];
+    size_t size = 0;
+    FILE *out;
+
+    if (nchannels > 1000) {
+        fprintf(stderr, "Too many channels.\n");
+        exit(-1);
+    }
+    strcpy(header, "Channel");
+    chan_table = device->parse_header(header);
+    strcpy(header, "Bank");
+    bank_table = device->parse_header(header);
+
+    render_tables(&old, nchannels);
+
+    radio_begin();
+    radio_parse_config(filename);
+    if (! table_erased[chan_table]) {
+        // No channels in the configuration.
+        radio_commit();
+        free_tables(&old);
+        return;
+    }
+    render_tables(&new, nchannels);
+
+    // Channels with the same contents keep their slots:
+    // first in place, then moved from another number.
+    memset(slot, 0, sizeof(slot));
+    memset(taken, 0, sizeof(taken));
+    for (n=1; n<=nchannels; n++) {
+        if (new.chan[n] && old.chan[n] && strcmp(new.chan[n], old.chan[n]) == 0) {
+            slot[n] = n;
+            taken[n] = 1;
+        }
+    }
+    for (n=1; n<=nchannels; n++) {
+        if (! new.chan[n] || slot[n])
+            continue;
+        for (s=1; s<=nchannels; s++) {
+            if (! taken[s] && old.chan[s] && strcmp(new.chan[n], old.chan[s]) == 0) {
+                slot[n] = s;
+                taken[s] = 1;
+                break;
+            }
+        }
+    }
+
+    // New channels: own number when free, then slots
+    // of removed channels, then empty slots.
+    for (n=1; n<=nchannels; n++) {
+        if (new.chan[n] && ! slot[n] && ! taken[n]) {
+            slot[n] = n;
+            taken[n] = 1;
+        }
+    }
+    for (pass=0; pass<2; pass++) {
+        s = 1;
+        for (n=1; n<=nchannels; n++) {
+            if (! new.chan[n] || slot[n])
+                continue;
+            while (s <= nchannels && (taken[s] || (pass == 0 && ! old.chan[s])))
+                s++;
+            if (s > nchannels)
+                break;
+            slot[n] = s;
+            taken[s] = 1;
+        }
+    }
+    for (n=1; n<=nchannels; n++) {
+        if (new.chan[n] && ! slot[n]) {
+            fprintf(stderr, "%s: No free memory slot for channel %d.\n", filename, n);
+            exit(-1);
+        }
+    }
+
+    // Build tables with channels in their slots.
+    out = open_memstream(&text, &size);
+    if (! out) {
+        perror("open_memstream");
+        exit(-1);
+    }
+    memset(chan_at, 0, sizeof(chan_at));
+    for (n=1; n<=nchannels; n++)
+        chan_at[slot[n]] = n;
+    fprintf(out, "%s\n", new.chan_header);
+    for (s=1; s<=nchannels; s++) {
+        if (chan_at[s])
+            fprintf(out, "%5d%s\n", s, new.chan[chan_at[s]]);
+    }
+    if (bank_table && table_erased[bank_table]) {
+        fprintf(out, "Bank    Channels\n");
+        for (n=1; n<=100; n++) {
+            if (new.bank[n]) {
+                char *list = new.bank[n] + strspn(new.bank[n], " ");
+                print_mapped_bank(out, n, list, slot);
+            }
+        }
+    }
+    fclose(out);
+
+    // Apply the configuration to the original image, then replace
+    // channels and banks by the mapped tables.
+    radio_rollback();
+    radio_parse_config(filename);
+    table_erased[chan_table] = 0;
+    table_erased[bank_table] = 0;
+    fprintf(stderr, "Keep channels in their memory slots.\n");
+    parse_fragment("(stable assignment)", 0, text);
+
+    free_tables(&old);
+    free_tables(&new);
+}
+
+//
+// Parse squelch value of the query: '-', nnn.n, -nnn.n or Dnnn.
+//
+static void parse_query_squelch(const char *value, int *kind, int *code)
+{
+    float hz;
+
+    if (strcmp(value, "-") == 0) {
+        *kind = Q_NONE;
+    } else if (*value == 'D' || *value == 'd') {
+        if (sscanf(value+1, "%d", code) != 1)
+            goto bad;
+        *kind = Q_DCS;
+    } else {
+        if (sscanf(value, "%f", &hz) != 1)
+            goto bad;
+        *kind = Q_CTCS;
+        *code = (hz < 0) ? (int)(hz * 10.0 - 0.5) : (int)(hz * 10.0 + 0.5);
+    }
+    return;
+bad:
+    fprintf(stderr, "Invalid squelch in query: %s\n", value);
+    exit(-1);
+}
+
+//
+// Parse the query: list of field=value terms, separated by spaces.
+//  rx=lower-upper          Receive frequency range in MHz, or rx=freq
+//  rsq=tone, tsq=tone      Receive and transmit squelch: '-', nnn.n or Dnnn
+//  power=name              Transmit power
+//  mod=name                Modulation
+//  scan=name               Scan mode: +, -, Only
+//
+static void parse_query(char *query, radio_query_t *q)
+{
+    char *term, *value;
+
+    memset(q, 0, sizeof(*q));
+    for (term = strtok(query, " \t,"); term; term = strtok(0, " \t,")) {
+        value = strchr(term, '=');
+        if (! value) {
+            if (strcasecmp(term, "and") == 0)
+                continue;
+            goto bad;
+        }
+        *value++ = 0;
+
+        if (strcasecmp(term, "rx") == 0) {
+            double lo, hi;
+            int n = sscanf(value, "%lf-%lf", &lo, &hi);
+            if (n < 1)
+                goto bad;
+            if (n == 1)
+                hi = lo;
+            q->rx_lo = (int)(lo * 1000000.0 + 0.5);
+            q->rx_hi = (int)(hi * 1000000.0 + 0.5);
+            if (q->rx_lo <= 0 || q->rx_hi < q->rx_lo)
+                goto bad;
+        } else if (strcasecmp(term, "rsq") == 0) {
+            parse_query_squelch(value, &q->rsq_kind, &q->rsq_value);
+        } else if (strcasecmp(term, "tsq") == 0) {
+            parse_query_squelch(value, &q->tsq_kind, &q->tsq_value);
+        } else if (strcasecmp(term, "power") == 0) {
+            q->power = value;
+        } else if (strcasecmp(term, "mod") == 0) {
+            q->mod = value;
+        } else if (strcasecmp(term, "scan") == 0) {
+            q->scan = value;
+        } else {
+            value[-1] = '=';
+            goto bad;
+        }
+    }
+    return;
+bad:
+    fprintf(stderr, "Invalid query term: %s\n", term);
+    exit(-1);
+}
+
+//
+// Find index of CTCSS tone or DCS code.
+// Return -1 when not found.
+//
+static int find_code(const int *table, int n, int code)
+{
+    int i;
+
+    for (i=0; i<n; i++)
+        if (table[i] == code)
+            return i;
+    return -1;
+}
+
+//
+// Parse squelch value: get its kind and the index of tone or DCS code.
+// Format: '-', nnn.n, -nnn.n (reverse tone) or Dnnn.
+//
+static void parse_squelch(const char *str, int *kind, int *index, int *rev)
+{
+    float hz;
+    unsigned code;
+
+    *kind = Q_NONE;
+    *index = -1;
+    *rev = (*str == '-' && str[1] >= '0' && str[1] <= '9');
+    str += *rev;
+
+    if ((*str == 'D' || *str == 'd') && sscanf(str+1, "%u", &code) == 1) {
+        *index = find_code(DCS_CODES, NDCS, code);
+        *kind = Q_DCS;
+    } else if (*str >= '0' && *str <= '9' && sscanf(str, "%f", &hz) == 1) {
+        *index = find_code(CTCSS_TONES, NCTCSS, (int) (hz * 10.0 + 0.5));
+        *kind = Q_CTCS;
+    }
+    if (*index < 0)
+        *kind = Q_NONE;
+}
+
+//
+// Convert squelch strings to tmode value, tone index and DCS index.
+// Parsed values select the tmode from the table of the model,
+// and the table tells which value gives the tone and the DCS code.
+//
+int radio_encode_squelch(const radio_squelch_t *sq, const char *rx, const char *tx,
+    int *tone, int *dcs)
+{
+    int rx_kind, rx_index, rx_rev, tx_kind, tx_index, tx_rev, tmode;
+
+    parse_squelch(rx, &rx_kind, &rx_index, &rx_rev);
+    parse_squelch(tx, &tx_kind, &tx_index, &tx_rev);
+    if (tx_rev)
+        tx_kind = Q_NONE;
+
+    tmode = sq->tmode[rx_rev][rx_kind][tx_kind];
+    int tones[3] = { sq->tone_default, rx_index, tx_index };
+    int codes[3] = { 0, rx_index, tx_index };
+    *tone = tones[sq->tone_src[tmode]];
+    *dcs = codes[sq->dcs_src[tmode]];
+    return tmode;
+}
+
+//
+// Convert tmode value, tone index and DCS index to squelch values.
+// Kinds of squelch come from the table of the model.
+//
+void radio_decode_squelch(const radio_squelch_t *sq, int tmode, int tone, int dcs,
+    int *rx_ctcs, int *tx_ctcs, int *rx_dcs, int *tx_dcs)
+{
+    int hz = CTCSS_TONES[tone < NCTCSS ? tone : 0];
+    int code = DCS_CODES[dcs < NDCS ? dcs : 0];
+
+    *rx_ctcs = (sq->rx_kind[tmode] == Q_CTCS) * hz * (1 - 2*sq->rx_rev[tmode]);
+    *tx_ctcs = (sq->tx_kind[tmode] == Q_CTCS) * hz;
+    *rx_dcs = (sq->rx_kind[tmode] == Q_DCS) * code;
+    *tx_dcs = (sq->tx_kind[tmode] == Q_DCS) * code;
+}
+
+//
+// Does squelch of given kind satisfy the predicate?
+//
+static int match_squelch(int want_kind, int want_code, int kind, int is_rev)
+{
+    if (want_kind == Q_ANY)
+        return 1;
+    if (want_kind != kind)
+        return 0;
+    if (kind == Q_CTCS)
+        return (want_code < 0) == is_rev;
+    return 1;
+}
+
+//
+// Compile squelch predicates into a set of tmode values.
+// Required tone and DCS indexes are returned, or -1.
+//
+unsigned radio_query_tmodes(const radio_query_t *q, const radio_squelch_t *sq,
+    int *tone, int *dcs)
+{
+    unsigned tmodes = 0;
+    int t, index;
+
+    for (t=0; t<sq->ntmodes; t++) {
+        if (match_squelch(q->rsq_kind, q->rsq_value, sq->rx_kind[t], sq->rx_rev[t]) &&
+            match_squelch(q->tsq_kind, q->tsq_value, sq->tx_kind[t], 0))
+            tmodes |= 1 << t;
+    }
+
+    // Both squelch values share one tone and one DCS field.
+    *tone = *dcs = -1;
+    if (q->rsq_kind == Q_CTCS) {
+        *tone = find_code(CTCSS_TONES, NCTCSS, abs(q->rsq_value));
+        if (*tone < 0)
+            return 0;
+    } else if (q->rsq_kind == Q_DCS) {
+        *dcs = find_code(DCS_CODES, NDCS, q->rsq_value);
+        if (*dcs < 0)
+            return 0;
+    }
+    if (q->tsq_kind == Q_CTCS) {
+        index = find_code(CTCSS_TONES, NCTCSS, q->tsq_value);
+        if (index < 0 || (*tone >= 0 && *tone != index))
+            return 0;
+        *tone = index;
+    } else if (q->tsq_kind == Q_DCS) {
+        index = find_code(DCS_CODES, NDCS, q->tsq_value);
+        if (index < 0 || (*dcs >= 0 && *dcs != index))
+            return 0;
+        *dcs = index;
+    }
+    return tmodes;
+}
+
+//
+// Compile a name predicate into a set of field values.
+//
+unsigned radio_query_names(const char *value, const char *field,
+    const char **names, int nnames)
+{
+    unsigned set = 0;
+    int i;
+
+    if (! value)
+        return ~0;
+    for (i=0; i<nnames; i++)
+        if (strcasecmp(names[i], value) == 0)
+            set |= 1 << i;
+    if (! set) {
+        fprintf(stderr, "Invalid %s in query: %s\n", field, value);
+        exit(-1);
+    }
+    return set;
+}
+
+//
+// Print memory channels matching the query, for every image file.
+//
+void radio_query(char *query, int nimages, char **images)
+{
+    radio_query_t q;
+    int i, count = 0;
+
+    parse_query(query, &q);
+    for (i=0; i<nimages; i++) {
+        radio_read_image(images[i]);
+        if (nimages > 1)
+            printf("%s%s:\n", i ? "\n" : "", images[i]);
+        count += device->query(stdout, &q);
+    }
+    fprintf(stderr, "%d channels found.\n", count);
 }
 
 //
@@ -262,7 +1766,7 @@ void radio_print_config(FILE *out, int verbose)
         time_t t;
         struct tm *tmp;
 
-        t = time(NULL);
+        t = clock_usec() / 1000000;
         tmp = localtime(&t);
         if (! tmp || ! strftime(buf, sizeof(buf), "%Y/%m/%d ", tmp))
             buf[0] = 0;
@@ -271,5 +1775,7 @@ void radio_print_config(FILE *out, int verbose)
         fprintf(out, "# Version %s, %s\n", version, copyright);
         fprintf(out, "#\n");
     }
+    radio_timeline_begin("render", device->name);
     device->print_config(out, verbose);
+    radio_timeline_end();
 }
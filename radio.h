@@ -47,6 +47,12 @@ void radio_download(void);
 //
 void radio_upload(int cont_flag);
 
+//
+// Load the last image of the named radio, as downloaded or uploaded
+// by a previous session with the same name.  Return 0 when not found.
+//
+int radio_recall_image(const char *name);
+
 //
 // Print a generic information about the device.
 //
@@ -72,12 +78,193 @@ void radio_save_image(char *filename);
 //
 void radio_parse_config(char *filename);
 
+//
+// Read the configuration, keeping channels of the current image
+// in their memory slots.
+//
+void radio_parse_config_stable(char *filename);
+
+//
+// Parse the configuration for the radio type before connecting,
+// and compile it for the following radio_parse_config().
+//
+void radio_preflight_config(const char *radio_type, char *filename);
+
+//
+// Read the configuration from text in memory, and modify the firmware.
+//
+void radio_parse_text(const char *name, char *text);
+
+//
+// Apply rows of configuration text on top of the current image.
+//
+void radio_parse_rows(const char *name, const char *text);
+
+//
+// Update memory channels of the image by the difference
+// between two snapshots of a repeater directory.
+// Updated rows of the channel table are printed to out.
+//
+void radio_sync(FILE *out, const char *old_csv, const char *new_csv);
+
+//
+// Load firmware image from the golden image linked into the binary.
+//
+void radio_load_plan(const char *name);
+
+//
+// Print names of golden images.
+//
+void radio_print_plans(FILE *out);
+
+//
+// Timeout for the radio to reset after a session.
+//
+#define RADIO_RESET_MSEC 2000
+
+//
+// Estimate session times, and simulate the list of jobs on the station.
+//
+void radio_estimate(int nports, const char *timing_file, int njobs, char **jobs);
+
+//
+// Type name of the current device: ft60, vx2.
+//
+const char *radio_type(void);
+
+//
+// Number of memory channels of the current device.
+//
+int radio_nchannels(void);
+
+//
+// Compare desired state of every radio with its last known image.
+//
+void radio_reconcile(const char *fleet, const char *outdir);
+
+//
+// Print ranges of radio memory which differ from the original contents.
+// Return the number of bytes changed.
+//
+int radio_print_regions(FILE *out, const unsigned char *before, int size);
+
+//
+// Run the batch job from a manifest file.
+//
+void radio_batch(const char *manifest);
+
+//
+// Run commands of the script against a set of images in memory.
+//
+void radio_script(const char *filename);
+
+//
+// Build images of all sections of the bundle, in parallel.
+//
+void radio_bundle(const char *filename, const char *outdir, int njobs);
+
+//
+// Print memory channels matching the query, for every image file.
+//
+void radio_query(char *query, int nimages, char **images);
+
+//
+// Channel query: conjunction of predicates over memory channels.
+// Fields not constrained are zero.
+//
+enum {
+    Q_ANY = 0,                          // Squelch not constrained
+    Q_NONE,                             // Squelch disabled
+    Q_CTCS,                             // CTCSS tone
+    Q_DCS,                              // DCS code
+};
+
+typedef struct {
+    int rx_lo, rx_hi;                   // Receive frequency range in Hz
+    int rsq_kind, rsq_value;            // Receive squelch: tone in 0.1 Hz
+                                        // (negative for reverse), or DCS code
+    int tsq_kind, tsq_value;            // Transmit squelch
+    const char *power;                  // Names of power level,
+    const char *mod;                    // modulation
+    const char *scan;                   // and scan mode
+} radio_query_t;
+
+//
+// Squelch modes of a model: compile-time tables, indexed by tmode,
+// and the tmode for every combination of receive and transmit squelch.
+// Tone and DCS index of a tmode come from one of the squelch values.
+//
+enum {
+    SQ_DEFAULT = 0,                     // Field not used
+    SQ_RX,                              // Taken from receive squelch
+    SQ_TX,                              // Taken from transmit squelch
+};
+
+typedef struct {
+    int ntmodes;
+    unsigned char rx_kind [8];          // Kind of receive squelch: Q_NONE, Q_CTCS, Q_DCS
+    unsigned char tx_kind [8];          // Kind of transmit squelch
+    unsigned char rx_rev [8];           // Receive tone is reversed
+    unsigned char tone_src [8];         // Source of tone index: SQ_*
+    unsigned char dcs_src [8];          // Source of DCS index
+    unsigned char tmode [2][4][4];      // Tmode by reverse flag, receive
+                                        // and transmit kind
+    int tone_default;                   // Tone index when not used
+} radio_squelch_t;
+
+//
+// Convert squelch strings to tmode value, tone index and DCS index.
+// Receive squelch is '-', nnn.n, -nnn.n (reverse tone) or Dnnn;
+// unknown values disable the squelch.
+//
+int radio_encode_squelch(const radio_squelch_t *sq, const char *rx, const char *tx,
+    int *tone, int *dcs);
+
+//
+// Convert tmode value, tone index and DCS index to squelch values:
+// tone in 0.1 Hz (negative for reverse) and DCS code, or 0.
+//
+void radio_decode_squelch(const radio_squelch_t *sq, int tmode, int tone, int dcs,
+    int *rx_ctcs, int *tx_ctcs, int *rx_dcs, int *tx_dcs);
+
+//
+// Compile squelch predicates into a set of tmode values.
+// Required tone and DCS indexes are returned, or -1.
+//
+unsigned radio_query_tmodes(const radio_query_t *q, const radio_squelch_t *sq,
+    int *tone, int *dcs);
+
+//
+// Compile a name predicate into a set of field values.
+//
+unsigned radio_query_names(const char *value, const char *field,
+    const char **names, int nnames);
+
+//
+// Traffic of one transfer, for estimation of session time.
+//
+typedef struct {
+    int bytes;                          // Bytes on the wire, including acks
+    int handshakes;                     // Waits for the other side to reply
+    int pause_usec;                     // Pacing delays
+} radio_wire_t;
+
+//
+// Region of memory which rarely changes, for the fingerprint of the radio.
+//
+typedef struct {
+    int start;
+    int nbytes;
+} radio_region_t;
+
 //
 // Device-dependent interface to the radio.
 //
 typedef struct {
     const char *name;
     int baud;
+    int nchannels;                      // Number of memory channels
+    const radio_region_t *fingerprint;  // Stable regions, by address, ended by zero size
     void (*download)(void);
     void (*upload)(int cont_flag);
     int (*is_compatible)(void);
@@ -88,21 +275,186 @@ typedef struct {
     void (*parse_parameter)(char *param, char *value);
     int (*parse_header)(char *line);
     int (*parse_row)(int table_id, int first_row, char *line);
+    int (*query)(FILE *out, const radio_query_t *q);
+    void (*wire)(int upload, radio_wire_t *w);
+    int (*next_channel)(int i, char *name, int *rx_hz);
+    void (*print_channel)(FILE *out, int i);
+    int (*set_channel)(char *line);
+    void (*erase_channel)(int i);
 } radio_device_t;
 
+//
+// Values of first_row argument of parse_row().
+//
+#define ROW_NEXT        0       // Continuation of the table
+#define ROW_FIRST       1       // First row of the table: clear it
+#define ROW_FRAGMENT    2       // First row in a later fragment: keep contents
+
+//
+// Golden image, compiled into the binary at build time (see mkplans.sh).
+//
+typedef struct {
+    const char *name;                   // Plan name, for option -p
+    int size;                           // Image size, selects the model
+    const unsigned char *data;          // Image contents
+} radio_plan_t;
+
+extern const radio_plan_t radio_plans[]; // Terminated by zero name
+
 extern radio_device_t radio_ft60;       // Yaesu FT-60R
 extern radio_device_t radio_vx2;        // Yaesu VX-2R, VX-2E
 
+//
+// Find device by type name: ft60, vx2.
+// Return 0 when unknown.
+//
+radio_device_t *radio_find_type(const char *radio_type);
+
+//
+// Device of the current image, and selection of another one,
+// for images kept aside by the caller and copied back into radio_mem.
+//
+radio_device_t *radio_current_device(void);
+void radio_select_device(radio_device_t *dev);
+
 //
 // Radio: memory contents.
 //
 extern unsigned char radio_mem[];
 
 //
-// Radio: identifier
+// Generation of memory contents: incremented when the whole image
+// is replaced by a read, download or restore.
+//
+extern unsigned radio_mem_epoch;
+
+//
+// Transaction on the image: every write by the drivers is journaled
+// with the original bytes, so the changes can be undone.
+//
+void radio_begin(void);
+void radio_commit(void);
+void radio_rollback(void);
+
+//
+// Save the original bytes of the image before writing them.
+// Does nothing outside of transaction.
+//
+void radio_journal(const void *addr, int nbytes);
+
+//
+// Fill bytes of the image, with journal.
+//
+void radio_memset(void *addr, int c, int nbytes);
+
+//
+// Bitmap of used memory slots: channels, then PMS records.
+// Built by the driver from its image, and updated on edits.
+//
+#define RADIO_MAXSLOTS  1280
+
+typedef struct {
+    unsigned long long word [RADIO_MAXSLOTS / 64];
+    unsigned epoch;                     // Generation of the image
+    int valid;                          // Map is built
+} radio_slots_t;
+
+//
+// Mark slot as used or free.
+//
+void radio_slots_set(radio_slots_t *map, int i, int used);
+
+//
+// Find next used slot, starting from i.
+// Return nslots when there are no more.
+//
+int radio_slots_next(const radio_slots_t *map, int i, int nslots);
+
+//
+// Run the session of the clone protocol on the real-time I/O thread,
+// and print its messages until it completes.
+//
+void radio_rt_run(void (*func)(int), int arg);
+
+//
+// Request real-time priority and locked memory for the I/O thread,
+// pinned to the given CPU, when not negative.
+//
+void radio_rt_setup(int cpu);
+
+//
+// Calls of the clone protocol, safe on the I/O thread.
+// Messages and blocks are passed to the main thread for printing.
+//
+void radio_message(int to_stdout, const char *fmt, ...);
+void radio_block(int start, int is_write, const unsigned char *data, int nbytes);
+void radio_wait_enter(void);
+void radio_fail(void);
+
+//
+// Radio: identifier, the fingerprint of stable regions of memory.
 //
 extern unsigned char radio_ident[8];
 
+//
+// Add block of memory to the fingerprint, when blocks come in order
+// of addresses; the block at 0 starts a new one.  Radio_ident is set
+// when the last region is complete.
+//
+void radio_fingerprint_block(int start, const unsigned char *data, int nbytes);
+
+//
+// Health of ports: a summary of every session is appended to the store
+// in the cache, with times of acknowledge and problems of the protocol.
+//
+enum {
+    HEALTH_ECHO,                        // Echo of the cable lost or corrupted
+    HEALTH_RETRY,                       // Transfer repeated
+    HEALTH_TIMEOUT,                     // No reply in time
+};
+
+void radio_health_begin(const char *port_name);
+void radio_health_end(void);
+void radio_health_event(int kind);
+
+//
+// Stop the protocol when the operator pressed ^C.
+//
+void radio_health_check(void);
+
+//
+// Read acknowledge of the radio, and measure the time it takes.
+// Return the number of bytes received: 1, or 0 on timeout.
+//
+int radio_read_ack(int fd, unsigned char *reply);
+
+//
+// Print a rolling health score of every port, from the store.
+//
+void radio_health_report(FILE *out);
+
+//
+// Timeline of the session in Trace Event Format: spans of phases
+// and stages, and instants of blocks.  Calls do nothing until
+// radio_timeline_open().
+//
+void radio_timeline_open(const char *filename);
+void radio_timeline_process(const char *name);
+void radio_timeline_begin(const char *name, const char *detail);
+void radio_timeline_end(void);
+void radio_timeline_instant(const char *name, int addr, int nbytes);
+
+//
+// Switch the phase of the clone protocol, or end it with null name.
+//
+void radio_timeline_phase(const char *name);
+
+//
+// Directory for cached patches, images and the health store.
+// Return 0 when caching is not possible.
+//
+const char *radio_cache_dir(void);
+
 //
 // File descriptor of serial port with programming cable attached.
 //
@@ -0,0 +1,144 @@
+/*
+ * Reconciliation of the radio fleet with the desired configurations.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "radio.h"
+#include "util.h"
+
+//
+// Ranges of image closer than this are reported as one region.
+//
+#define MERGE_GAP       8
+
+//
+// Print ranges of radio memory which differ from the original contents.
+// Return the number of bytes changed.
+//
+int radio_print_regions(FILE *out, const unsigned char *before, int size)
+{
+    int addr, start, end, nbytes = 0, nregions = 0;
+
+    for (addr=0; addr<size; ) {
+        if (radio_mem[addr] == before[addr]) {
+            addr++;
+            continue;
+        }
+
+        // Extend the region over small gaps.
+        start = end = addr;
+        for (addr++; addr<size && addr-end <= MERGE_GAP; addr++) {
+            if (radio_mem[addr] != before[addr])
+                end = addr;
+        }
+        nbytes += end - start + 1;
+        fprintf(out, "%s0x%04x-0x%04x", nregions ? "," : " ", start, end);
+        nregions++;
+        addr = end + 1;
+    }
+    return nbytes;
+}
+
+//
+// Compare desired state of every radio with its last known image.
+// Fleet file has lines: name image.img desired.conf
+// For every radio out of date, print a line:
+//      name type image.img desired.conf regions nbytes
+// When outdir is given, desired images are saved as outdir/name.img,
+// all synced to disk at once.  Invalid lines are reported and skipped;
+// the program then exits with an error at the end.
+//
+void radio_reconcile(const char *fleet, const char *outdir)
+{
+    static unsigned char before [0x10000];
+    static const char *TYPES[] = { "ft60", "vx2" };
+    int counts[2] = { 0, 0 };
+    char line[1024], name[256], image[512], conf[512];
+    int line_num = 0, nradios = 0, nstale = 0, nbad = 0, i;
+    FILE *fd;
+
+    fd = fopen(fleet, "r");
+    if (! fd) {
+        perror(fleet);
+        exit(-1);
+    }
+    file_batch_begin();
+    while (fgets(line, sizeof(line), fd)) {
+        char *p;
+        int nbytes;
+
+        line_num++;
+        p = strchr(line, '#');
+        if (p)
+            *p = 0;
+        if (line[strspn(line, " \t\r\n")] == 0)
+            continue;
+        if (sscanf(line, "%255s %511s %511s", name, image, conf) != 3) {
+            fprintf(stderr, "%s: Invalid line %d.\n", fleet, line_num);
+            nbad++;
+            continue;
+        }
+        nradios++;
+
+        // Apply desired configuration to the last known image.
+        memset(radio_mem, 0, sizeof(before));
+        radio_read_image(image);
+        memcpy(before, radio_mem, sizeof(before));
+        radio_parse_config(conf);
+        if (memcmp(radio_mem, before, sizeof(before)) == 0)
+            continue;
+
+        // Radio is out of date.
+        nstale++;
+        for (i=0; i<2; i++)
+            if (strcmp(radio_type(), TYPES[i]) == 0)
+                counts[i]++;
+        printf("%s %s %s %s", name, radio_type(), image, conf);
+        nbytes = radio_print_regions(stdout, before, sizeof(before));
+        printf(" %d\n", nbytes);
+
+        if (outdir) {
+            char path[1024];
+
+            snprintf(path, sizeof(path), "%s/%s.img", outdir, name);
+            radio_save_image(path);
+        }
+    }
+    fclose(fd);
+    file_batch_commit();
+
+    fprintf(stderr, "%d of %d radios out of date.", nstale, nradios);
+    for (i=0; i<2; i++)
+        if (counts[i])
+            fprintf(stderr, " %s:write:%d", TYPES[i], counts[i]);
+    fprintf(stderr, "\n");
+    if (nbad > 0) {
+        fprintf(stderr, "%s: %d invalid lines skipped.\n", fleet, nbad);
+        exit(-1);
+    }
+}
@@ -0,0 +1,454 @@
+/*
+ * Real-time I/O thread for the clone protocol.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "radio.h"
+#include "util.h"
+
+//
+// Print hex dump of the block, or a progress mark every 16 blocks.
+//
+static void show_block(int start, int is_write, const unsigned char *data, int nbytes)
+{
+    if (serial_verbose) {
+        printf("# %s 0x%04x: ", is_write ? "Write" : "Read", start);
+        print_hex(data, nbytes);
+        printf("\n");
+    } else {
+        ++radio_progress;
+        if (radio_progress % 16 == 0) {
+            fprintf(stderr, "#");
+            fflush(stderr);
+        }
+    }
+}
+
+//
+// Wait for <Enter> on terminal.
+//
+static void read_enter()
+{
+    char buf[80];
+
+    fflush(stderr);
+    if (! fgets(buf, sizeof(buf), stdin))
+        /*ignore*/;
+}
+
+#ifndef MINGW32
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+//
+// The clone protocol runs on a dedicated thread, which only touches
+// the serial port and the memory image.  Everything else - messages,
+// hex dumps, progress, reading the terminal - is done by the main thread.
+// Threads talk through two lock-free single-producer, single-consumer rings.
+//
+enum {
+    EV_TEXT,                            // Message to stderr
+    EV_STDOUT,                          // Message to stdout
+    EV_BLOCK,                           // Block received or sent
+    EV_PROMPT,                          // Wait for <Enter> on terminal
+    EV_REPLY,                           // <Enter> pressed
+    EV_FAIL,                            // Session failed: exit
+    EV_DONE,                            // Session completed
+};
+
+#define EV_DATASZ       120             // Text of message or data of block
+#define RING_SIZE       256             // Power of two
+
+typedef struct {
+    short type;                         // EV_xxx
+    short nbytes;                       // Length of data
+    int addr;                           // Start address of block, write flag
+    short lost_blocks;                  // Blocks dropped before this event
+    short lost_text;                    // Messages dropped before this event
+    char data [EV_DATASZ];
+} event_t;
+
+typedef struct {
+    atomic_uint head;                   // Advanced by producer
+    atomic_uint tail;                   // Advanced by consumer
+    event_t slot [RING_SIZE];
+} ring_t;
+
+static ring_t to_main;                  // From I/O thread to main thread
+static ring_t to_io;                    // From main thread to I/O thread
+
+static int rt_active;                   // Session is running on the I/O thread
+static int rt_enable;                   // Use real-time priority and locked memory
+static int rt_cpu = -1;                 // Pin I/O thread to this CPU
+
+static void (*rt_func)(int);            // Session of the I/O thread
+static int rt_arg;
+
+static int lost_blocks;                 // Dropped by I/O thread, not yet reported
+static int lost_text;
+static int rt_overruns;                 // Events dropped in the session
+
+//
+// Get the free slot of the ring, or 0 when less than
+// reserve+1 slots are free.
+//
+static event_t *ring_slot(ring_t *r, unsigned reserve)
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (head - tail + reserve >= RING_SIZE)
+        return 0;
+    return &r->slot[head & (RING_SIZE - 1)];
+}
+
+//
+// Publish the slot filled by producer.
+//
+static void ring_push(ring_t *r)
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+//
+// Get the oldest event of the ring, or 0 when empty.
+//
+static event_t *ring_peek(ring_t *r)
+{
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    if (tail == head)
+        return 0;
+    return &r->slot[tail & (RING_SIZE - 1)];
+}
+
+//
+// Release the event taken by consumer.
+//
+static void ring_pop(ring_t *r)
+{
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+//
+// Send event to the main thread.
+// The protocol thread never waits for the terminal: when the ring
+// is full, messages and blocks are dropped and counted.  Blocks
+// leave a quarter of the ring free for messages.  Only the prompt
+// and the end of session wait for a free slot.
+//
+static void post(int type, int addr, const void *data, int nbytes)
+{
+    event_t *ev;
+
+    if (type == EV_PROMPT || type == EV_FAIL || type == EV_DONE) {
+        while (! (ev = ring_slot(&to_main, 0)))
+            clock_sleep(1000);
+    } else {
+        ev = ring_slot(&to_main, (type == EV_BLOCK) ? RING_SIZE/4 : 0);
+        if (! ev) {
+            if (type == EV_BLOCK)
+                lost_blocks++;
+            else
+                lost_text++;
+            return;
+        }
+    }
+
+    ev->type = type;
+    ev->addr = addr;
+    ev->nbytes = nbytes;
+    ev->lost_blocks = lost_blocks;
+    ev->lost_text = lost_text;
+    lost_blocks = lost_text = 0;
+    if (nbytes > 0)
+        memcpy(ev->data, data, nbytes);
+    ring_push(&to_main);
+}
+
+//
+// Account for events dropped by the I/O thread.
+// Dropped blocks still advance the progress marks.
+//
+static void count_lost(const event_t *ev)
+{
+    int marks;
+
+    rt_overruns += ev->lost_blocks + ev->lost_text;
+    if (ev->lost_blocks && ! serial_verbose) {
+        marks = (radio_progress + ev->lost_blocks) / 16 - radio_progress / 16;
+        radio_progress += ev->lost_blocks;
+        while (marks-- > 0)
+            fprintf(stderr, "#");
+    }
+}
+
+//
+// Report events dropped in the session.
+//
+static void report_overruns()
+{
+    if (rt_overruns > 0)
+        fprintf(stderr, "\nWarning: %d messages of the I/O thread dropped, terminal too slow.\n",
+            rt_overruns);
+    rt_overruns = 0;
+}
+
+//
+// Handle events of the I/O thread.
+// Return 0 when the session is done.
+//
+static int drain()
+{
+    event_t *ev, *reply;
+
+    while ((ev = ring_peek(&to_main))) {
+        count_lost(ev);
+        switch (ev->type) {
+        case EV_TEXT:
+            fwrite(ev->data, 1, ev->nbytes, stderr);
+            break;
+        case EV_STDOUT:
+            fwrite(ev->data, 1, ev->nbytes, stdout);
+            break;
+        case EV_BLOCK:
+            show_block(ev->addr >> 1, ev->addr & 1,
+                (unsigned char*) ev->data, ev->nbytes);
+            break;
+        case EV_PROMPT:
+            read_enter();
+            while (! (reply = ring_slot(&to_io, 0)))
+                clock_sleep(1000);
+            reply->type = EV_REPLY;
+            reply->nbytes = 0;
+            ring_push(&to_io);
+            break;
+        case EV_FAIL:
+            fflush(stdout);
+            report_overruns();
+            exit(-1);
+        case EV_DONE:
+            ring_pop(&to_main);
+            return 0;
+        }
+        ring_pop(&to_main);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    return 1;
+}
+
+//
+// Body of the I/O thread.
+//
+static void *io_thread(void *arg)
+{
+    rt_func(rt_arg);
+    post(EV_DONE, 0, 0, 0);
+    clock_detach();
+    return 0;
+}
+
+//
+// Start the I/O thread with real-time attributes when requested.
+// Return 0 when the attributes are not permitted.
+//
+static int start_thread(pthread_t *tid, int realtime)
+{
+    pthread_attr_t attr;
+    int status;
+
+    pthread_attr_init(&attr);
+    if (realtime) {
+        struct sched_param param;
+
+        param.sched_priority = (sched_get_priority_min(SCHED_FIFO) +
+                                sched_get_priority_max(SCHED_FIFO)) / 2;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+#ifdef __linux__
+    if (rt_cpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(rt_cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+#endif
+    clock_attach();
+    status = pthread_create(tid, &attr, io_thread, 0);
+    pthread_attr_destroy(&attr);
+    if (status != 0)
+        clock_detach();
+    if (status == EPERM || (status == EINVAL && rt_cpu >= 0))
+        return 0;
+    if (status != 0) {
+        fprintf(stderr, "Cannot start I/O thread: %s\n", strerror(status));
+        exit(-1);
+    }
+    return 1;
+}
+#endif
+
+//
+// Request real-time attributes of the I/O thread:
+// FIFO scheduling, locked memory, and the CPU, when not negative.
+//
+void radio_rt_setup(int cpu)
+{
+#ifndef MINGW32
+    rt_enable = 1;
+    rt_cpu = cpu;
+#endif
+}
+
+//
+// Run the session of the clone protocol on the I/O thread,
+// and handle its messages until it completes.
+//
+void radio_rt_run(void (*func)(int), int arg)
+{
+#ifdef MINGW32
+    func(arg);
+#else
+    pthread_t tid;
+
+    if (rt_enable && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        fprintf(stderr, "Warning: cannot lock memory: %s\n", strerror(errno));
+
+    rt_func = func;
+    rt_arg = arg;
+    rt_active = 1;
+    if (! start_thread(&tid, rt_enable)) {
+        fprintf(stderr, "Warning: real-time %s not permitted.\n",
+            (rt_cpu >= 0) ? "priority or CPU" : "priority");
+        rt_cpu = -1;
+        start_thread(&tid, 0);
+    }
+
+    while (drain())
+        clock_sleep(1000);
+    pthread_join(tid, 0);
+    rt_active = 0;
+    report_overruns();
+
+    if (rt_enable)
+        munlockall();
+#endif
+}
+
+//
+// Print message of the clone protocol, to stderr or to stdout.
+//
+void radio_message(int to_stdout, const char *fmt, ...)
+{
+    va_list args;
+#ifndef MINGW32
+    if (rt_active) {
+        char buf[EV_DATASZ * 4];
+        int len, i, n;
+
+        va_start(args, fmt);
+        len = vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        if (len >= sizeof(buf))
+            len = sizeof(buf) - 1;
+
+        for (i=0; i<len; i+=n) {
+            n = (len - i < EV_DATASZ) ? len - i : EV_DATASZ;
+            post(to_stdout ? EV_STDOUT : EV_TEXT, 0, buf + i, n);
+        }
+        return;
+    }
+#endif
+    va_start(args, fmt);
+    vfprintf(to_stdout ? stdout : stderr, fmt, args);
+    va_end(args);
+    fflush(stderr);
+}
+
+//
+// Report block of the clone protocol: hex dump or progress.
+//
+void radio_block(int start, int is_write, const unsigned char *data, int nbytes)
+{
+    radio_timeline_instant(is_write ? "block tx" : "block rx", start, nbytes);
+#ifndef MINGW32
+    if (rt_active) {
+        post(EV_BLOCK, start << 1 | is_write, data, nbytes);
+        return;
+    }
+#endif
+    show_block(start, is_write, data, nbytes);
+}
+
+//
+// Wait for <Enter> on terminal, before the radio is ready to receive.
+//
+void radio_wait_enter()
+{
+#ifndef MINGW32
+    if (rt_active) {
+        post(EV_PROMPT, 0, 0, 0);
+        while (! ring_peek(&to_io))
+            clock_sleep(1000);
+        ring_pop(&to_io);
+        return;
+    }
+#endif
+    read_enter();
+}
+
+//
+// Fail the session of the clone protocol: halt the program
+// when all messages are printed.
+//
+void radio_fail()
+{
+#ifndef MINGW32
+    if (rt_active) {
+        post(EV_FAIL, 0, 0, 0);
+        clock_detach();
+        pthread_exit(0);
+    }
+#endif
+    exit(-1);
+}
@@ -0,0 +1,326 @@
+/*
+ * Script of commands against a set of images in memory.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "radio.h"
+#include "util.h"
+
+//
+// Image of the set: a copy of radio_mem with its device.
+// The current image lives in radio_mem, its copy is updated
+// when another image is selected.
+//
+typedef struct {
+    char *name;
+    radio_device_t *device;
+    unsigned char *mem;
+} image_t;
+
+static image_t *images;
+static int nimages;
+static int current = -1;                // Index of image in radio_mem
+static char *model;                     // Radio type for download
+
+static const char *script_name;         // For messages
+static int line_num;
+static char *rows;                      // Pending lines of 'set' commands
+static int rows_len;
+
+static void fail(const char *fmt, const char *arg)
+{
+    fprintf(stderr, "%s: Line %d: ", script_name, line_num);
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    exit(-1);
+}
+
+static image_t *find_image(const char *name)
+{
+    int i;
+
+    for (i=0; i<nimages; i++)
+        if (strcmp(images[i].name, name) == 0)
+            return &images[i];
+    return 0;
+}
+
+//
+// Save radio_mem to the current image of the set.
+//
+static void save_current()
+{
+    if (current < 0)
+        return;
+    memcpy(images[current].mem, radio_mem, 0x10000);
+    images[current].device = radio_current_device();
+}
+
+//
+// Make the image current: copy it into radio_mem.
+//
+static void select_image(image_t *img)
+{
+    if (current == img - images)
+        return;
+    save_current();
+    memcpy(radio_mem, img->mem, 0x10000);
+    radio_select_device(img->device);
+    current = img - images;
+}
+
+//
+// Take the contents of radio_mem as the image with this name,
+// replacing the old one.
+//
+static void define_image(const char *name)
+{
+    image_t *img = find_image(name);
+
+    if (! img) {
+        images = realloc(images, (nimages + 1) * sizeof(image_t));
+        if (! images) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+        img = &images[nimages++];
+        img->name = strdup(name);
+        img->mem = malloc(0x10000);
+        if (! img->name || ! img->mem) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+    }
+    current = img - images;
+    save_current();
+}
+
+static void need_image(const char *cmd)
+{
+    if (current < 0)
+        fail("%s: No image loaded.", cmd);
+}
+
+//
+// Apply the pending lines of 'set' commands, as one fragment:
+// a table header is followed by its rows.
+//
+static void flush_rows()
+{
+    if (! rows)
+        return;
+    radio_parse_rows(script_name, rows);
+    free(rows);
+    rows = 0;
+    rows_len = 0;
+}
+
+static void add_row(const char *line)
+{
+    int len = strlen(line);
+
+    rows = realloc(rows, rows_len + len + 2);
+    if (! rows) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    memcpy(rows + rows_len, line, len);
+    rows_len += len;
+    rows[rows_len++] = '\n';
+    rows[rows_len] = 0;
+}
+
+//
+// Print the configuration of the current image.
+// File name "-" means standard output.
+//
+static void render(char *filename)
+{
+    FILE *conf;
+
+    fprintf(stderr, "Print configuration to file '%s'.\n", filename);
+    if (strcmp(filename, "-") == 0) {
+        radio_print_version(stdout);
+        radio_print_config(stdout, 1);
+        fflush(stdout);
+        return;
+    }
+    conf = file_create(filename);
+    radio_print_version(conf);
+    radio_print_config(conf, 1);
+    file_commit(conf);
+}
+
+//
+// Print regions where the current image differs from another one.
+//
+static void diff(const char *name)
+{
+    image_t *img = find_image(name);
+    int nbytes;
+
+    if (! img)
+        fail("Unknown image: %s", name);
+    if (img->device != radio_current_device()) {
+        printf("%s %s: different models\n", images[current].name, name);
+        return;
+    }
+    printf("%s %s", images[current].name, name);
+    nbytes = radio_print_regions(stdout, img->mem, 0x10000);
+    printf(" %d\n", nbytes);
+    fflush(stdout);
+}
+
+//
+// Perform one command.
+//  model type              - radio type for download: ft60, vx2
+//  load name file.img      - read image file into the set
+//  use name                - make the image current
+//  copy name               - duplicate the current image, make it current
+//  apply file.conf         - apply configuration to the current image
+//  set line                - apply a line of configuration
+//  render file.conf        - print configuration of the current image
+//  save file.img           - write the current image to file
+//  diff name               - compare the current image with another one
+//  download port name      - read the radio into the set
+//  upload port             - write the current image to the radio
+//
+static void run_command(int argc, char **argv)
+{
+    image_t *img;
+
+    if (strcmp(argv[0], "model") == 0 && argc == 2) {
+        if (! radio_find_type(argv[1]))
+            fail("Unknown radio type: %s", argv[1]);
+        free(model);
+        model = strdup(argv[1]);
+
+    } else if (strcmp(argv[0], "load") == 0 && argc == 3) {
+        save_current();
+        memset(radio_mem, 0, 0x10000);
+        radio_read_image(argv[2]);
+        define_image(argv[1]);
+
+    } else if (strcmp(argv[0], "use") == 0 && argc == 2) {
+        img = find_image(argv[1]);
+        if (! img)
+            fail("Unknown image: %s", argv[1]);
+        select_image(img);
+
+    } else if (strcmp(argv[0], "copy") == 0 && argc == 2) {
+        need_image(argv[0]);
+        save_current();
+        define_image(argv[1]);
+
+    } else if (strcmp(argv[0], "apply") == 0 && argc == 2) {
+        need_image(argv[0]);
+        radio_parse_config(argv[1]);
+
+    } else if (strcmp(argv[0], "render") == 0 && argc == 2) {
+        need_image(argv[0]);
+        render(argv[1]);
+
+    } else if (strcmp(argv[0], "save") == 0 && argc == 2) {
+        need_image(argv[0]);
+        radio_save_image(argv[1]);
+
+    } else if (strcmp(argv[0], "diff") == 0 && argc == 2) {
+        need_image(argv[0]);
+        diff(argv[1]);
+
+    } else if (strcmp(argv[0], "download") == 0 && argc == 3) {
+        if (! model)
+            fail("%s: No radio model selected.", argv[0]);
+        save_current();
+        radio_connect(argv[1], model);
+        radio_download();
+        radio_disconnect();
+        define_image(argv[2]);
+
+    } else if (strcmp(argv[0], "upload") == 0 && argc == 2) {
+        need_image(argv[0]);
+        radio_connect(argv[1], 0);
+        radio_upload(0);
+        radio_disconnect();
+
+    } else {
+        fail("Unknown command or wrong number of arguments: %s", argv[0]);
+    }
+}
+
+//
+// Run commands of the script, one per line.  File name "-" means
+// standard input, so commands can come from a pipe as they are produced.
+// Images stay in memory between commands; any error stops the script.
+//
+void radio_script(const char *filename)
+{
+    char line[1024], copy[1024], *argv[8], *p;
+    int argc;
+    FILE *fd;
+
+    script_name = filename;
+    if (strcmp(filename, "-") == 0) {
+        fd = stdin;
+        script_name = "stdin";
+    } else {
+        fd = fopen(filename, "r");
+        if (! fd) {
+            perror(filename);
+            exit(-1);
+        }
+    }
+    while (fgets(line, sizeof(line), fd)) {
+        line_num++;
+        p = strchr(line, '\n');
+        if (p)
+            *p = 0;
+
+        // Line of configuration: keep it as is, with comments and spaces.
+        if (strncmp(line, "set ", 4) == 0 || strncmp(line, "set\t", 4) == 0) {
+            need_image("set");
+            add_row(line + 4);
+            continue;
+        }
+        flush_rows();
+
+        p = strchr(line, '#');
+        if (p)
+            *p = 0;
+        strcpy(copy, line);
+        argc = 0;
+        for (p = strtok(copy, " \t\r"); p && argc < 8; p = strtok(0, " \t\r"))
+            argv[argc++] = p;
+        if (argc == 0)
+            continue;
+        run_command(argc, argv);
+    }
+    flush_rows();
+    if (fd != stdin)
+        fclose(fd);
+}
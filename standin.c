@@ -0,0 +1,288 @@
+/*
+ * Radio simulated in this process, for tests without a cable.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "util.h"
+
+#ifdef MINGW32
+int standin_open(const char *filename, int baud)
+{
+    fprintf(stderr, "Simulated radio is not supported.\n");
+    exit(-1);
+}
+
+void standin_close(int fd)
+{
+}
+#else
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define MAXBLOCKS       1024
+
+//
+// The radio sits on the other end of a socket pair, on its own thread,
+// and behaves like the radio in clone mode behind the programming cable:
+// it echoes every byte it receives, and takes the wire time of the data
+// at the baud rate.  The operator presses PTT when the tool waits for data,
+// as seen by the virtual clock, so the radio sends the image; when the tool
+// sends first, the radio receives the image and saves it to the file.
+// Models are told by the baud rate:
+//      FT-60: 9600 baud, bulk blocks are acknowledged, checksum sent last
+//      VX-2:  19200 baud, two header blocks, bulk blocks without acknowledge
+//
+static const char *image_file;          // Memory of the radio
+static int memsz;                       // Image size, without checksum
+static int baud_rate;
+static unsigned char image [0x10000];
+static int nblocks;                     // Block sizes in the clone stream
+static int block [MAXBLOCKS];
+static int need_ack [MAXBLOCKS];
+static int radio_fd = -1;               // Radio end of the socket pair
+static int tool_fd = -1;                // Tool end of the socket pair
+static pthread_t tid;
+
+//
+// Wire time of nbytes: 10 bits per byte.
+//
+static void wire_delay(int nbytes)
+{
+    clock_sleep(nbytes * 10000000LL / baud_rate);
+}
+
+//
+// Read exactly nbytes, echoing them back like the single-wire cable.
+// Return 0 on timeout or when the tool is gone.
+//
+static int read_echo(unsigned char *data, int nbytes, long long timeout_usec)
+{
+    int n;
+
+    while (nbytes > 0) {
+        if (! clock_wait_input(radio_fd, timeout_usec))
+            return 0;
+        n = read(radio_fd, data, nbytes);
+        if (n <= 0)
+            return 0;
+        if (send(radio_fd, data, n, MSG_NOSIGNAL) != n)
+            return 0;
+        data += n;
+        nbytes -= n;
+    }
+    return 1;
+}
+
+//
+// Radio sends the image: PTT pressed.
+//
+static void radio_send()
+{
+    unsigned char ack;
+    int i, addr;
+
+    for (i=0, addr=0; i<nblocks; addr+=block[i++]) {
+        if (send(radio_fd, &image[addr], block[i], MSG_NOSIGNAL) != block[i])
+            return;
+        wire_delay(block[i]);
+        if (need_ack[i] && (! read_echo(&ack, 1, 2000000) || ack != 0x06)) {
+            fprintf(stderr, "Simulated radio: No acknowledge at 0x%04x.\n", addr);
+            return;
+        }
+    }
+}
+
+//
+// Save the memory of the radio to the file.  Pending files of the tool
+// belong to its own thread, so a plain temporary file is renamed
+// into place.
+//
+static void save_image()
+{
+    char tmpname [1100];
+    FILE *img;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.radio", image_file);
+    img = fopen(tmpname, "wb");
+    if (! img) {
+        perror(tmpname);
+        return;
+    }
+    if (fwrite(image, 1, memsz + 1, img) != memsz + 1 || fclose(img) != 0 ||
+        rename(tmpname, image_file) < 0) {
+        perror(image_file);
+        unlink(tmpname);
+    }
+}
+
+//
+// Radio receives the image and saves it, when the checksum is good.
+//
+static void radio_receive()
+{
+    unsigned char *data = &image[0];
+    int i, addr, sum;
+
+    for (i=0, addr=0; i<nblocks; addr+=block[i++]) {
+        if (! read_echo(&data[addr], block[i], 2000000)) {
+            fprintf(stderr, "Simulated radio: Timeout at 0x%04x.\n", addr);
+            return;
+        }
+        wire_delay(block[i]);
+        if (need_ack[i] && send(radio_fd, "\x06", 1, MSG_NOSIGNAL) != 1)
+            return;
+    }
+    for (sum=0, addr=0; addr<memsz; addr++)
+        sum += image[addr];
+    if ((sum & 0xff) != image[memsz]) {
+        fprintf(stderr, "Simulated radio: Bad checksum.\n");
+        return;
+    }
+    save_image();
+}
+
+//
+// Thread of the radio: wait for the tool to send, or to wait for data.
+// The operator repeats the procedure when the tool asks, until
+// the tool disconnects.
+//
+static void *radio_thread(void *arg)
+{
+    unsigned char c;
+
+    for (;;) {
+        if (clock_wait_input(radio_fd, 10000)) {
+            if (recv(radio_fd, &c, 1, MSG_PEEK) <= 0)
+                break;
+            radio_receive();
+        } else if (clock_input_wanted(tool_fd)) {
+            radio_send();
+        }
+    }
+    clock_detach();
+    return 0;
+}
+
+//
+// Split the clone stream into blocks: header blocks, then bulk
+// blocks of 64 bytes.
+//
+static void make_blocks(int nheader, const int *header, int bulk_ack)
+{
+    int i, addr, n;
+
+    nblocks = 0;
+    addr = 0;
+    for (i=0; i<nheader; i++) {
+        need_ack[nblocks] = 1;
+        block[nblocks++] = header[i];
+        addr += header[i];
+    }
+    while (addr < memsz + 1) {
+        n = memsz + 1 - addr;
+        if (bulk_ack && addr < memsz && n > memsz - addr)
+            n = memsz - addr;
+        if (n > 64)
+            n = 64;
+        need_ack[nblocks] = bulk_ack;
+        block[nblocks++] = n;
+        addr += n;
+    }
+}
+
+//
+// Start the radio with memory from the image file.
+// Return the file descriptor of the tool end.
+//
+int standin_open(const char *filename, int baud)
+{
+    static const int ft60_header[] = { 8 };
+    static const int vx2_header[] = { 10, 8 };
+    const char *ident;
+    int sv[2], addr, sum;
+    FILE *img;
+
+    if (baud == 19200) {
+        ident = "AH015$";
+        memsz = 32594;
+        make_blocks(2, vx2_header, 0);
+    } else {
+        ident = "AH017$";
+        memsz = 0x6fc8;
+        make_blocks(1, ft60_header, 1);
+    }
+    image_file = filename;
+    baud_rate = baud;
+
+    // Blank radio when there is no file yet.
+    memset(image, 0xff, sizeof(image));
+    memcpy(image, ident, strlen(ident));
+    img = fopen(filename, "rb");
+    if (img) {
+        if (fread(image, 1, memsz + 1, img) != memsz + 1) {
+            fprintf(stderr, "%s: Bad image size, need %d bytes.\n",
+                filename, memsz + 1);
+            exit(-1);
+        }
+        fclose(img);
+    }
+
+    // Radio computes the checksum when it sends.
+    for (sum=0, addr=0; addr<memsz; addr++)
+        sum += image[addr];
+    image[memsz] = sum;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(-1);
+    }
+    radio_fd = sv[1];
+    tool_fd = sv[0];
+    clock_attach();
+    if (pthread_create(&tid, 0, radio_thread, 0) != 0) {
+        perror("pthread_create");
+        exit(-1);
+    }
+    return sv[0];
+}
+
+//
+// Disconnect the tool and wait for the radio to finish.
+// The time runs without the caller meanwhile.
+//
+void standin_close(int fd)
+{
+    close(fd);
+    clock_detach();
+    pthread_join(tid, 0);
+    clock_attach();
+    close(radio_fd);
+    radio_fd = -1;
+}
+#endif
@@ -0,0 +1,439 @@
+/*
+ * Incremental sync of memory channels with a repeater directory.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "radio.h"
+#include "util.h"
+
+//
+// Fields of a channel, in the order of channel table columns.
+//
+enum {
+    F_RX, F_TX, F_RSQ, F_TSQ, F_POWER, F_MOD, F_SCAN, NFIELDS,
+    F_CALL = NFIELDS,                   // Column of callsign
+    F_NONE = -1,                        // Column ignored
+};
+
+//
+// Columns of the directory file, case insensitive.
+//
+static const struct {
+    const char *name;
+    int field;
+} COLUMNS[] = {
+    { "Callsign",   F_CALL },
+    { "Frequency",  F_RX },
+    { "Receive",    F_RX },
+    { "Offset",     F_TX },
+    { "Transmit",   F_TX },
+    { "R-Squel",    F_RSQ },
+    { "Tone",       F_TSQ },
+    { "T-Squel",    F_TSQ },
+    { "Power",      F_POWER },
+    { "Modulation", F_MOD },
+    { "Mode",       F_MOD },
+    { "Scan",       F_SCAN },
+    { 0,            F_NONE },
+};
+
+//
+// Repeater from the directory, or memory channel from the image.
+//
+typedef struct {
+    char call[16];                      // Callsign, upper case
+    char name[8];                       // Name of memory channel
+    long rx;                            // Receive frequency, 100 Hz units
+    char value[NFIELDS][16];            // Field values, empty when not given
+    int slot;                           // Number of memory channel
+} entry_t;
+
+typedef struct {
+    entry_t *entry;
+    int count;
+    char have[NFIELDS];                 // Column is present
+} snapshot_t;
+
+static long frequency_key(double mhz)
+{
+    return (long) (mhz * 10000.0 + 0.5);
+}
+
+static void add_entry(snapshot_t *s, const entry_t *e)
+{
+    if (s->count % 256 == 0) {
+        s->entry = realloc(s->entry, (s->count + 256) * sizeof(entry_t));
+        if (! s->entry) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(-1);
+        }
+    }
+    s->entry[s->count++] = *e;
+}
+
+//
+// Directory entries are ordered by callsign and frequency.
+//
+static int compare_call(const void *a, const void *b)
+{
+    const entry_t *x = a, *y = b;
+    int cmp = strcmp(x->call, y->call);
+
+    if (cmp)
+        return cmp;
+    return (x->rx > y->rx) - (x->rx < y->rx);
+}
+
+//
+// Memory channels are found by name and frequency.
+//
+static int compare_name(const void *a, const void *b)
+{
+    const entry_t *x = a, *y = b;
+    int cmp = strcmp(x->name, y->name);
+
+    if (cmp)
+        return cmp;
+    return (x->rx > y->rx) - (x->rx < y->rx);
+}
+
+//
+// Split the line into comma separated cells.
+// Spaces and quotes around the values are removed.
+//
+static int split_cells(char *line, char **cell, int maxcells)
+{
+    int n = 0;
+    char *p, *end;
+
+    for (p=line; n<maxcells; p++) {
+        cell[n++] = p;
+        p = strchr(p, ',');
+        if (p)
+            *p = 0;
+        end = cell[n-1] + strlen(cell[n-1]);
+        while (*cell[n-1] == ' ' || *cell[n-1] == '\t' || *cell[n-1] == '"')
+            cell[n-1]++;
+        while (end > cell[n-1] && (end[-1] == ' ' || end[-1] == '\t' ||
+            end[-1] == '"' || end[-1] == '\r' || end[-1] == '\n'))
+            *--end = 0;
+        if (! p)
+            break;
+    }
+    return n;
+}
+
+//
+// Read a snapshot of the repeater directory.
+// The first line is a header with names of columns.
+//
+static void read_directory(const char *filename, snapshot_t *s)
+{
+    char line[1024], *cell[32];
+    int column[32], ncolumns = 0, line_num = 0, n, i, k;
+    FILE *fd;
+
+    memset(s, 0, sizeof(*s));
+    fd = fopen(filename, "r");
+    if (! fd) {
+        perror(filename);
+        exit(-1);
+    }
+    while (fgets(line, sizeof(line), fd)) {
+        entry_t e;
+
+        line_num++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0)
+            continue;
+        n = split_cells(line, cell, 32);
+
+        if (! ncolumns) {
+            // Header: find columns by name.
+            int have_call = 0;
+
+            for (i=0; i<n; i++) {
+                for (k=0; COLUMNS[k].name; k++)
+                    if (strcasecmp(cell[i], COLUMNS[k].name) == 0)
+                        break;
+                column[i] = COLUMNS[k].field;
+                if (column[i] == F_CALL)
+                    have_call = 1;
+                else if (column[i] != F_NONE)
+                    s->have[column[i]] = 1;
+            }
+            if (! have_call || ! s->have[F_RX]) {
+                fprintf(stderr, "%s: No Callsign or Frequency column.\n", filename);
+                exit(-1);
+            }
+            ncolumns = n;
+            continue;
+        }
+
+        memset(&e, 0, sizeof(e));
+        for (i=0; i<n && i<ncolumns; i++) {
+            if (column[i] == F_CALL) {
+                for (k=0; cell[i][k] && k<sizeof(e.call)-1; k++)
+                    e.call[k] = toupper(cell[i][k]);
+            } else if (column[i] == F_RX) {
+                char *end;
+                double mhz = strtod(cell[i], &end);
+
+                if (end == cell[i] || *end || mhz <= 0) {
+                    fprintf(stderr, "%s: Bad frequency at line %d.\n", filename, line_num);
+                    exit(-1);
+                }
+                e.rx = frequency_key(mhz);
+            } else if (column[i] != F_NONE) {
+                snprintf(e.value[column[i]], sizeof(e.value[0]), "%s", cell[i]);
+            }
+        }
+        if (! e.call[0] || ! e.rx)
+            continue;
+
+        // Channel name is the callsign, without spaces.
+        for (k=0; e.call[k] && k<6; k++)
+            e.name[k] = (e.call[k] == ' ') ? '_' : e.call[k];
+        snprintf(e.value[F_RX], sizeof(e.value[0]), "%.4f", e.rx / 10000.0);
+        add_entry(s, &e);
+    }
+    fclose(fd);
+
+    // Sort by key, and drop duplicates.
+    qsort(s->entry, s->count, sizeof(entry_t), compare_call);
+    for (i=n=0; i<s->count; i++) {
+        if (n > 0 && compare_call(&s->entry[n-1], &s->entry[i]) == 0) {
+            fprintf(stderr, "%s: Duplicate entry %s %s ignored.\n",
+                filename, s->entry[i].call, s->entry[i].value[F_RX]);
+            continue;
+        }
+        s->entry[n++] = s->entry[i];
+    }
+    s->count = n;
+}
+
+//
+// Get names and frequencies of used memory channels from the image.
+// Other fields are loaded only for channels being rewritten.
+//
+static void read_channels(radio_device_t *dev, snapshot_t *s)
+{
+    int i, rx_hz;
+    entry_t e;
+
+    memset(s, 0, sizeof(*s));
+    memset(&e, 0, sizeof(e));
+    for (i=dev->next_channel(0, e.name, &rx_hz); i<dev->nchannels;
+         i=dev->next_channel(i+1, e.name, &rx_hz)) {
+        e.rx = frequency_key(rx_hz / 1000000.0);
+        e.slot = i + 1;
+        add_entry(s, &e);
+        memset(&e, 0, sizeof(e));
+    }
+    qsort(s->entry, s->count, sizeof(entry_t), compare_name);
+}
+
+//
+// Get all fields of the memory channel, from its row of the channel table.
+//
+static void load_values(radio_device_t *dev, entry_t *ch)
+{
+    char *text = 0, num[256], name[256], rx[256];
+    size_t size = 0;
+    FILE *out;
+
+    out = open_memstream(&text, &size);
+    if (! out) {
+        perror("open_memstream");
+        exit(-1);
+    }
+    dev->print_channel(out, ch->slot - 1);
+    fclose(out);
+
+    if (sscanf(text, "%255s %255s %255s %15s %15s %15s %15s %15s %15s",
+        num, name, rx, ch->value[F_TX], ch->value[F_RSQ], ch->value[F_TSQ],
+        ch->value[F_POWER], ch->value[F_MOD], ch->value[F_SCAN]) != 9) {
+        fprintf(stderr, "Channel %d: Cannot read.\n", ch->slot);
+        exit(-1);
+    }
+    snprintf(ch->value[F_RX], sizeof(ch->value[0]), "%.4f", ch->rx / 10000.0);
+    free(text);
+}
+
+//
+// Find memory channel of the repeater.
+//
+static entry_t *find_channel(snapshot_t *image, const entry_t *e)
+{
+    return bsearch(e, image->entry, image->count, sizeof(entry_t), compare_name);
+}
+
+static int same_values(const entry_t *a, const entry_t *b)
+{
+    return memcmp(a->value, b->value, sizeof(a->value)) == 0;
+}
+
+//
+// Update memory channels of the image by the difference
+// between two snapshots of a repeater directory.
+// Only changed repeaters are looked up in the image,
+// and only their channels are rewritten.
+// Updated rows of the channel table are printed to out.
+//
+void radio_sync(FILE *out, const char *old_csv, const char *new_csv)
+{
+    static char used [1000+1];
+    radio_device_t *dev = radio_current_device();
+    snapshot_t old, new, image;
+    entry_t **removed, **updated, *ch;
+    int nremoved = 0, nupdated = 0, nchanged = 0, nadded = 0, ndeleted = 0;
+    int i, j, f, cmp, free_slot = 1, *reuse, nreuse = 0;
+    char line[256];
+
+    read_directory(old_csv, &old);
+    read_directory(new_csv, &new);
+
+    // Difference of snapshots.
+    removed = malloc((old.count + 1) * sizeof(entry_t*));
+    updated = malloc((new.count + 1) * sizeof(entry_t*));
+    reuse = malloc((old.count + 1) * sizeof(int));
+    if (! removed || ! updated || ! reuse) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    for (i=j=0; i<old.count || j<new.count; ) {
+        cmp = (i >= old.count) ? 1 : (j >= new.count) ? -1 :
+            compare_call(&old.entry[i], &new.entry[j]);
+        if (cmp < 0) {
+            removed[nremoved++] = &old.entry[i++];
+        } else if (cmp > 0) {
+            updated[nupdated++] = &new.entry[j++];
+        } else {
+            if (! same_values(&old.entry[i], &new.entry[j]))
+                updated[nupdated++] = &new.entry[j];
+            i++;
+            j++;
+        }
+    }
+    fprintf(stderr, "Directory: %d entries, %d removed, %d new or changed.\n",
+        new.count, nremoved, nupdated);
+
+    if (dev->nchannels > 1000) {
+        fprintf(stderr, "Too many channels.\n");
+        exit(-1);
+    }
+    read_channels(dev, &image);
+    memset(used, 0, sizeof(used));
+    for (i=0; i<image.count; i++)
+        used[image.entry[i].slot] = 1;
+
+    fprintf(out, "Channel Name    Receive  Transmit R-Squel T-Squel Power Modulation Scan\n");
+
+    // Removed repeaters free their channels.
+    for (i=0; i<nremoved; i++) {
+        ch = find_channel(&image, removed[i]);
+        if (! ch || ! used[ch->slot])
+            continue;
+        used[ch->slot] = 0;
+        reuse[nreuse++] = ch->slot;
+    }
+
+    // New and changed repeaters: rewrite the channel in place,
+    // or take the channel of a removed repeater, or an empty one.
+    for (i=0; i<nupdated; i++) {
+        entry_t row = *updated[i];
+
+        ch = find_channel(&image, &row);
+        if (ch && used[ch->slot]) {
+            load_values(dev, ch);
+            row.slot = ch->slot;
+        } else if (nreuse > 0) {
+            ch = 0;
+            row.slot = reuse[--nreuse];
+        } else {
+            ch = 0;
+            while (free_slot <= dev->nchannels && used[free_slot])
+                free_slot++;
+            if (free_slot > dev->nchannels) {
+                fprintf(stderr, "No free memory slot for %s %s.\n", row.call, row.value[F_RX]);
+                exit(-1);
+            }
+            row.slot = free_slot;
+        }
+        used[row.slot] = 1;
+
+        // Columns not given in the directory keep the values
+        // of the channel, or get defaults.
+        for (f=0; f<NFIELDS; f++) {
+            if (row.value[f][0])
+                continue;
+            if (ch)
+                strcpy(row.value[f], ch->value[f]);
+            else
+                strcpy(row.value[f],
+                    f == F_TX    ? "+0" :
+                    f == F_POWER ? "High" :
+                    f == F_MOD   ? (strcmp(radio_type(), "vx2") == 0 ? "FM" : "Wide") :
+                    f == F_SCAN  ? "+" : "-");
+        }
+        if (ch && same_values(ch, &row))
+            continue;
+
+        snprintf(line, sizeof(line), "%5d   %-7s %-8s %-8s %-7s %-7s %-5s %-10s %s",
+            row.slot, row.name[0] ? row.name : "-", row.value[F_RX], row.value[F_TX],
+            row.value[F_RSQ], row.value[F_TSQ], row.value[F_POWER],
+            row.value[F_MOD], row.value[F_SCAN]);
+        fprintf(out, "%s\n", line);
+        if (! dev->set_channel(line)) {
+            fprintf(stderr, "(repeater directory): Invalid line: '%s'\n", line);
+            exit(-1);
+        }
+        if (ch)
+            nchanged++;
+        else
+            nadded++;
+    }
+
+    // Channels of removed repeaters, not taken by new ones,
+    // are cleared and removed from banks.
+    for (i=0; i<nreuse; i++) {
+        fprintf(out, "%5d   -       -        -        -       -       -     -          -\n",
+            reuse[i]);
+        dev->erase_channel(reuse[i] - 1);
+        ndeleted++;
+    }
+    fprintf(stderr, "Channels: %d added, %d changed, %d deleted.\n",
+        nadded, nchanged, ndeleted);
+
+    free(old.entry);
+    free(new.entry);
+    free(image.entry);
+    free(removed);
+    free(updated);
+    free(reuse);
+}
@@ -0,0 +1,444 @@
+/*
+ * Serial port over TCP: raw socket or RFC 2217 (Telnet COM Port Control).
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "util.h"
+
+//
+// Telnet protocol, RFC 854, RFC 2217.
+//
+#define IAC             255
+#define DONT            254
+#define DO              253
+#define WONT            252
+#define WILL            251
+#define SB              250
+#define SE              240
+
+#define OPT_BINARY      0
+#define OPT_COM_PORT    44
+
+#define CPC_SET_BAUDRATE    1
+#define CPC_SET_DATASIZE    2
+#define CPC_SET_PARITY      3
+#define CPC_SET_STOPSIZE    4
+#define CPC_SET_CONTROL     5
+#define CPC_PURGE_DATA      12
+
+#define CONNECT_MSEC    5000    // Timeout of connect to the port server
+
+//
+// States of Telnet receive filter.
+//
+enum {
+    TS_DATA,            // Plain data
+    TS_IAC,             // Got IAC
+    TS_OPTION,          // Got WILL/WONT/DO/DONT, need option code
+    TS_SB,              // Inside of subnegotiation
+    TS_SB_IAC,          // Got IAC inside of subnegotiation
+};
+
+static int telnet;                      // Use RFC 2217 protocol
+static int telnet_state;                // State of receive filter
+static int telnet_verb;                 // WILL/WONT/DO/DONT of the option
+static unsigned char local_on [256];    // Options we agreed to use
+static unsigned char remote_on [256];   // Options we agreed the server uses
+static int latency_usec;                // Added to read timeout
+static unsigned char outbuf [1024];     // Writes waiting for a reply
+static int outlen;
+
+//
+// Send data to the socket in one call.
+//
+static void send_all(int fd, const unsigned char *data, int len)
+{
+    while (len > 0) {
+        int n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            perror("Network port");
+            exit(-1);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+//
+// Send the queued output in one call.
+//
+static void push(int fd)
+{
+    if (outlen > 0) {
+        send_all(fd, outbuf, outlen);
+        outlen = 0;
+    }
+}
+
+//
+// Queue output.  Small writes are coalesced, and leave together
+// when a reply is needed: see tcp_read() and tcp_flush().
+//
+static void queue(int fd, const unsigned char *data, int len)
+{
+    if (outlen + len > sizeof(outbuf))
+        push(fd);
+    if (len > sizeof(outbuf)) {
+        send_all(fd, data, len);
+        return;
+    }
+    memcpy(outbuf + outlen, data, len);
+    outlen += len;
+}
+
+//
+// Send COM-PORT-OPTION subnegotiation with a value.
+//
+static void send_com_port(int fd, int command, unsigned value, int nbytes)
+{
+    unsigned char buf [16];
+    int len = 0;
+
+    buf[len++] = IAC;
+    buf[len++] = SB;
+    buf[len++] = OPT_COM_PORT;
+    buf[len++] = command;
+    while (nbytes-- > 0) {
+        buf[len] = value >> (nbytes * 8);
+        if (buf[len++] == IAC)
+            buf[len++] = IAC;
+    }
+    buf[len++] = IAC;
+    buf[len++] = SE;
+    queue(fd, buf, len);
+}
+
+//
+// Answer the option negotiation of the server, RFC 854.
+// Only binary mode and COM-PORT-OPTION are accepted, anything
+// else is refused.  Options already agreed to, like our own
+// requests at connect, are not answered again, so negotiation
+// cannot loop.  The reply leaves with the next output.
+//
+static void telnet_option(int fd, int verb, int opt)
+{
+    unsigned char reply [3];
+    int accept = (opt == OPT_BINARY || opt == OPT_COM_PORT);
+
+    reply[0] = IAC;
+    reply[2] = opt;
+    switch (verb) {
+    case DO:
+        if (accept && local_on[opt])
+            return;
+        local_on[opt] = accept;
+        reply[1] = accept ? WILL : WONT;
+        break;
+    case WILL:
+        if (accept && remote_on[opt])
+            return;
+        remote_on[opt] = accept;
+        reply[1] = accept ? DO : DONT;
+        break;
+    case DONT:
+        if (! local_on[opt])
+            return;
+        local_on[opt] = 0;
+        reply[1] = WONT;
+        break;
+    case WONT:
+        if (! remote_on[opt])
+            return;
+        remote_on[opt] = 0;
+        reply[1] = DONT;
+        break;
+    default:
+        return;
+    }
+    queue(fd, reply, sizeof(reply));
+}
+
+//
+// Remove Telnet commands from received data, in place.
+// Return the number of data bytes left.
+//
+static int telnet_filter(int fd, unsigned char *data, int len)
+{
+    int i, n = 0;
+
+    for (i=0; i<len; i++) {
+        int c = data[i];
+
+        switch (telnet_state) {
+        case TS_DATA:
+            if (c == IAC)
+                telnet_state = TS_IAC;
+            else
+                data[n++] = c;
+            break;
+        case TS_IAC:
+            if (c == IAC) {
+                // Escaped 0xff data byte.
+                data[n++] = c;
+                telnet_state = TS_DATA;
+            } else if (c == SB)
+                telnet_state = TS_SB;
+            else if (c >= WILL && c <= DONT) {
+                telnet_verb = c;
+                telnet_state = TS_OPTION;
+            }
+            else
+                telnet_state = TS_DATA;
+            break;
+        case TS_OPTION:
+            telnet_option(fd, telnet_verb, c);
+            telnet_state = TS_DATA;
+            break;
+        case TS_SB:
+            if (c == IAC)
+                telnet_state = TS_SB_IAC;
+            break;
+        case TS_SB_IAC:
+            telnet_state = (c == SE) ? TS_DATA : TS_SB;
+            break;
+        }
+    }
+    return n;
+}
+
+//
+// Connect the socket, waiting no longer than the timeout.
+// Return 0 on failure, with errno set.
+//
+static int connect_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct pollfd pfd;
+    int flags, err = 0;
+    socklen_t errlen = sizeof(err);
+
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (connect(fd, addr, addrlen) < 0) {
+        if (errno != EINPROGRESS)
+            return 0;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        switch (poll(&pfd, 1, CONNECT_MSEC)) {
+        case -1:
+            return 0;
+        case 0:
+            errno = ETIMEDOUT;
+            return 0;
+        }
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+            return 0;
+        if (err != 0) {
+            errno = err;
+            return 0;
+        }
+    }
+    fcntl(fd, F_SETFL, flags);
+    return 1;
+}
+
+//
+// Connect to the port server.
+// URL format: tcp://host:port or rfc2217://host:port.
+//
+int tcp_open(const char *url, int baud)
+{
+    struct addrinfo hints, *res, *ai;
+    char host [256], *port;
+    const char *p;
+    long long t0 = 0;
+    int fd = -1, one = 1;
+
+    telnet = (strncasecmp(url, "rfc2217://", 10) == 0);
+    telnet_state = TS_DATA;
+    memset(local_on, 0, sizeof(local_on));
+    memset(remote_on, 0, sizeof(remote_on));
+    outlen = 0;
+    p = strstr(url, "://") + 3;
+    strncpy(host, p, sizeof(host)-1);
+    host[sizeof(host)-1] = 0;
+    port = strrchr(host, ':');
+    if (! port || port == host) {
+        fprintf(stderr, "%s: Port number required.\n", url);
+        exit(-1);
+    }
+    *port++ = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "%s: Unknown host.\n", url);
+        exit(-1);
+    }
+
+    // The TCP handshake takes one round trip: use it
+    // to estimate the network latency.
+    for (ai=res; ai; ai=ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        t0 = clock_usec();
+        if (connect_timeout(fd, ai->ai_addr, ai->ai_addrlen))
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        perror(url);
+        exit(-1);
+    }
+
+    // Every reply from the radio costs an extra round trip
+    // over the network: extend read timeouts accordingly.
+    latency_usec = 2 * (clock_usec() - t0);
+
+    // Output is coalesced here, and pushed when a reply is needed.
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (telnet) {
+        static const unsigned char options[] = {
+            IAC, WILL, OPT_BINARY,
+            IAC, DO,   OPT_BINARY,
+            IAC, WILL, OPT_COM_PORT,
+        };
+        queue(fd, options, sizeof(options));
+        local_on[OPT_BINARY] = 1;
+        remote_on[OPT_BINARY] = 1;
+        local_on[OPT_COM_PORT] = 1;
+
+        // Set port mode: 8 data bits, no parity, 1 stop bit, no flow control.
+        send_com_port(fd, CPC_SET_BAUDRATE, baud, 4);
+        send_com_port(fd, CPC_SET_DATASIZE, 8, 1);
+        send_com_port(fd, CPC_SET_PARITY, 1, 1);
+        send_com_port(fd, CPC_SET_STOPSIZE, 1, 1);
+        send_com_port(fd, CPC_SET_CONTROL, 1, 1);
+    }
+    tcp_flush(fd);
+    return fd;
+}
+
+//
+// Close the connection.
+//
+void tcp_close(int fd)
+{
+    push(fd);
+    close(fd);
+}
+
+//
+// Purge all received data, locally and on the port server.
+// Queued output, like the port setup at connect, leaves
+// in the same segment as the purge command.
+//
+void tcp_flush(int fd)
+{
+    unsigned char buf [256];
+    int n;
+
+    if (telnet)
+        send_com_port(fd, CPC_PURGE_DATA, 1, 1);
+    push(fd);
+
+    while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if (telnet)
+            telnet_filter(fd, buf, n);
+    }
+}
+
+//
+// Read data from the connection.
+// Queued output goes first: the reply depends on it.
+// Return 0 when no data available.
+// Use 200-msec timeout, plus network latency.
+//
+int tcp_read(int fd, unsigned char *data, int len)
+{
+    int nbytes, len0 = len;
+
+    for (;;) {
+        // Replies to Telnet negotiation leave here too.
+        push(fd);
+        if (! clock_wait_input(fd, 200000 + latency_usec))
+            return 0;
+
+        nbytes = recv(fd, data, len, 0);
+        if (nbytes <= 0)
+            return 0;
+        if (telnet)
+            nbytes = telnet_filter(fd, data, nbytes);
+
+        len -= nbytes;
+        if (len <= 0)
+            return len0;
+
+        data += nbytes;
+    }
+}
+
+//
+// Write data to the connection, with 0xff bytes escaped for Telnet.
+// Writes are coalesced until the next read: a block, or an acknowledge
+// with anything written after it, leaves in a single TCP segment.
+//
+void tcp_write(int fd, const void *data, int len)
+{
+    const unsigned char *p = data;
+    unsigned char buf [2*64];
+    int i, n;
+
+    if (! telnet) {
+        queue(fd, data, len);
+        return;
+    }
+    while (len > 0) {
+        n = 0;
+        for (i=0; i<len && n < sizeof(buf) - 1; i++) {
+            buf[n++] = p[i];
+            if (p[i] == IAC)
+                buf[n++] = IAC;
+        }
+        queue(fd, buf, n);
+        p += i;
+        len -= i;
+    }
+}
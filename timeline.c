@@ -0,0 +1,289 @@
+/*
+ * Timeline of sessions in Trace Event Format, for a trace viewer.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifndef MINGW32
+#   include <pthread.h>
+#   include <sys/file.h>
+#endif
+#include "radio.h"
+#include "util.h"
+
+//
+// Events are collected in memory, and appended to the file at exit,
+// as lines of a JSON array.  The closing bracket is optional in this
+// format, so processes of a station can append to the same file,
+// and every process is a separate row in the viewer.
+// Threads: 1 is the main thread, 2 is the clone protocol.
+// Every thread has its own buffer, so the protocol thread never
+// waits for the main one; buffers are joined at exit, as the viewer
+// orders events by time.
+//
+typedef struct {
+    char *data;                         // Events, in JSON
+    int len, size;
+} events_t;
+
+#define PROTOCOL_BUFSZ  (256*1024)      // Enough for a session without realloc
+
+static const char *timeline_file;       // Output file, or 0 when disabled
+static events_t events [2];             // By thread: main and protocol
+static int pid;
+
+#ifndef MINGW32
+static pthread_t main_thread;
+#endif
+
+static events_t *thread_events(int tid)
+{
+    return &events[tid - 1];
+}
+
+static int thread_id()
+{
+#ifndef MINGW32
+    if (! pthread_equal(pthread_self(), main_thread))
+        return 2;
+#endif
+    return 1;
+}
+
+//
+// Append formatted text to the buffer of the thread.
+//
+static void append(events_t *ev, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    for (;;) {
+        va_start(ap, fmt);
+        len = vsnprintf(ev->data + ev->len, ev->size - ev->len, fmt, ap);
+        va_end(ap);
+        if (len < ev->size - ev->len)
+            break;
+        ev->size = (ev->size + len) * 2;
+        ev->data = realloc(ev->data, ev->size);
+        if (! ev->data) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+    }
+    ev->len += len;
+}
+
+//
+// Append the string as JSON, with quotes.
+//
+static void append_string(events_t *ev, const char *str)
+{
+    append(ev, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            append(ev, "\\%c", *str);
+        else if ((unsigned char)*str < ' ')
+            append(ev, "\\u%04x", *str);
+        else
+            append(ev, "%c", *str);
+    }
+    append(ev, "\"");
+}
+
+//
+// Start of event: common fields.
+//
+static events_t *append_event(const char *name, const char *ph)
+{
+    int tid = thread_id();
+    events_t *ev = thread_events(tid);
+
+    append(ev, "{\"name\":");
+    append_string(ev, name);
+    append(ev, ",\"ph\":\"%s\",\"ts\":%lld,\"pid\":%d,\"tid\":%d",
+        ph, clock_usec(), pid, tid);
+    return ev;
+}
+
+//
+// Write the events to the file.
+// A new file gets the opening bracket.
+//
+static void flush_timeline()
+{
+    int fd, i;
+
+    if (! timeline_file)
+        return;
+    fd = open(timeline_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror(timeline_file);
+        return;
+    }
+#ifndef MINGW32
+    flock(fd, LOCK_EX);
+#endif
+    if (lseek(fd, 0, SEEK_END) == 0 && write(fd, "[\n", 2) != 2)
+        perror(timeline_file);
+    for (i=0; i<2; i++) {
+        if (events[i].len > 0 &&
+            write(fd, events[i].data, events[i].len) != events[i].len)
+            perror(timeline_file);
+        events[i].len = 0;
+    }
+    close(fd);
+}
+
+//
+// Names of this process and its threads, for the viewer.
+//
+static void start_process(const char *name)
+{
+    pid = getpid();
+#ifndef MINGW32
+    main_thread = pthread_self();
+#endif
+    append(&events[0], "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":1,"
+        "\"args\":{\"name\":\"main\"}},\n", pid);
+    append(&events[0], "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":2,"
+        "\"args\":{\"name\":\"clone protocol\"}},\n", pid);
+    radio_timeline_process(name);
+}
+
+#ifndef MINGW32
+//
+// In a forked child: events of the parent are written by the parent.
+// The child starts anew, with its own pid.
+//
+static void start_child()
+{
+    events[0].len = 0;
+    events[1].len = 0;
+    start_process("yaesutool");
+}
+#endif
+
+//
+// Enable the timeline, written to the file at exit.
+//
+void radio_timeline_open(const char *filename)
+{
+    timeline_file = filename;
+    events[1].size = PROTOCOL_BUFSZ;
+    events[1].data = malloc(events[1].size);
+    if (! events[1].data) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    start_process("yaesutool");
+#ifndef MINGW32
+    pthread_atfork(0, 0, start_child);
+#endif
+    atexit(flush_timeline);
+}
+
+//
+// Name the row of this process in the viewer, like the serial port.
+//
+void radio_timeline_process(const char *name)
+{
+    events_t *ev = thread_events(thread_id());
+
+    if (! timeline_file)
+        return;
+    append(ev, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", pid);
+    append_string(ev, name);
+    append(ev, "}},\n");
+}
+
+//
+// Start a span of the current thread, with optional detail,
+// like the file name.  Spans of a thread are nested.
+//
+void radio_timeline_begin(const char *name, const char *detail)
+{
+    events_t *ev;
+
+    if (! timeline_file)
+        return;
+    ev = append_event(name, "B");
+    if (detail) {
+        append(ev, ",\"args\":{\"detail\":");
+        append_string(ev, detail);
+        append(ev, "}");
+    }
+    append(ev, "},\n");
+}
+
+//
+// End the last span of the current thread.
+//
+void radio_timeline_end()
+{
+    int tid = thread_id();
+
+    if (! timeline_file)
+        return;
+    append(thread_events(tid), "{\"ph\":\"E\",\"ts\":%lld,\"pid\":%d,\"tid\":%d},\n",
+        clock_usec(), pid, tid);
+}
+
+//
+// Mark an instant event on the current thread, like a block of data.
+// Called on the protocol thread: no locks.
+//
+void radio_timeline_instant(const char *name, int addr, int nbytes)
+{
+    events_t *ev;
+
+    if (! timeline_file)
+        return;
+    ev = append_event(name, "i");
+    append(ev, ",\"s\":\"t\",\"args\":{\"addr\":%d,\"nbytes\":%d}},\n", addr, nbytes);
+}
+
+//
+// Switch the phase of the clone protocol: end the previous phase,
+// and start the next one, when not null.  Phases are not nested,
+// so a driver can jump between them on errors.
+//
+void radio_timeline_phase(const char *name)
+{
+    static int phase_open;
+
+    if (! timeline_file)
+        return;
+    if (phase_open)
+        radio_timeline_end();
+    phase_open = (name != 0);
+    if (name)
+        radio_timeline_begin(name, 0);
+}
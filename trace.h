@@ -0,0 +1,63 @@
+/*
+ * Static tracepoints.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+// USDT probes of provider 'yaesutool', for bpftrace, perf or systemtap.
+// When <sys/sdt.h> is available, every probe compiles into a single
+// nop instruction plus an ELF note, so probes stay in release builds
+// and cost nothing until attached.  Otherwise they compile to nothing.
+// Build with -DNO_SDT to remove them.
+//
+// Probes and arguments:
+//  session_start(port, baud)       - serial port opened
+//  session_end()                   - serial port closed, before reset delay
+//  block_rx(addr, nbytes)          - block of data received from the radio
+//  block_tx(addr, nbytes)          - block of data sent to the radio
+//  echo(addr, nbytes)              - echo of a sent block received
+//  ack(addr, reply)                - acknowledge byte received
+//  pace(usec)                      - pacing delay before the next block
+//  checksum(computed, received)    - image checksum
+//  conf_row(table, first_row)      - configuration table row parsed
+//  row_render(table, index)        - configuration table row printed
+//
+#if !defined(NO_SDT) && !defined(MINGW32) && defined(__has_include)
+#   if __has_include(<sys/sdt.h>)
+#       include <sys/sdt.h>
+#       define HAVE_SDT 1
+#   endif
+#endif
+
+#ifdef HAVE_SDT
+#   define TRACE0(name)         DTRACE_PROBE(yaesutool, name)
+#   define TRACE1(name, a)      DTRACE_PROBE1(yaesutool, name, a)
+#   define TRACE2(name, a, b)   DTRACE_PROBE2(yaesutool, name, a, b)
+#else
+#   define TRACE0(name)         /* empty */
+#   define TRACE1(name, a)      /* empty */
+#   define TRACE2(name, a, b)   /* empty */
+#endif
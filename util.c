@@ -25,23 +25,32 @@
  * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #ifdef MINGW32
 #   include <windows.h>
 #else
 #   include <termios.h>
 #   include <sys/stat.h>
 #endif
+#include <libgen.h>
 #include "util.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 #ifdef MINGW32
 static DCB saved_mode;                  // Mode of serial port, Windows
 #else
 static struct termios oldtio, newtio;   // Mode of serial port, Unix
+static int port_is_tcp;                 // Serial port is a network connection
+static int port_is_sim;                 // Radio simulated in this process
 #endif
 
 //
@@ -78,12 +87,24 @@ const int DCS_CODES [NDCS] = {
 //
 int is_file(char *filename)
 {
+    if (strcmp(filename, "-") == 0) {
+        // Standard input.
+        return 1;
+    }
 #ifdef MINGW32
     // Treat COM* as a device.
     return strncasecmp(filename, "com", 3) != 0;
 #else
     struct stat st;
 
+    if (strstr(filename, "://")) {
+        // Network port.
+        return 0;
+    }
+    if (strncmp(filename, "sim:", 4) == 0) {
+        // Simulated radio.
+        return 0;
+    }
     if (stat(filename, &st) < 0) {
         // File not exist: treat it as a regular file.
         return 1;
@@ -92,6 +113,328 @@ int is_file(char *filename)
 #endif
 }
 
+//
+// Files created by file_create(), waiting for commit.
+//
+typedef struct {
+    FILE *fp;                           // Open stream, or 0 when closed
+    char *filename;                     // Final name of the file
+    char *tmpname;                      // Temporary name in the same directory
+} pending_file_t;
+
+static pending_file_t *pending;         // List of uncommitted files
+static int npending;                    // Number of uncommitted files
+static int batch_depth;                 // Nesting level of file_batch_begin()
+static int handover_fd = -1;            // Commits go to the parent process
+
+//
+// Remove temporary files left by an aborted batch.
+//
+static void discard_pending(void)
+{
+    int i;
+
+    for (i=0; i<npending; i++) {
+        if (pending[i].fp)
+            fclose(pending[i].fp);
+        unlink(pending[i].tmpname);
+    }
+    npending = 0;
+}
+
+//
+// Add a file to the pending list.
+//
+static pending_file_t *add_pending(const char *filename, char *tmpname)
+{
+    static int registered;
+    pending_file_t *p;
+
+    if (! registered) {
+        atexit(discard_pending);
+        registered = 1;
+    }
+    pending = realloc(pending, (npending + 1) * sizeof(pending_file_t));
+    if (! pending) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    p = &pending[npending++];
+    p->fp = 0;
+    p->filename = strdup(filename);
+    p->tmpname = tmpname;
+    if (! p->filename) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    return p;
+}
+
+//
+// Remove the entry i from the pending list.
+//
+static void remove_pending(int i)
+{
+    free(pending[i].filename);
+    free(pending[i].tmpname);
+    pending[i] = pending[--npending];
+}
+
+//
+// Return 1 when the file i of the list is the first one in its directory.
+// Store the directory name into dir[].
+//
+static int first_in_directory(int *list, int i, char *dir, int dirlen)
+{
+    char buf [1024];
+    int k;
+
+    strncpy(buf, pending[list[i]].filename, sizeof(buf)-1);
+    buf[sizeof(buf)-1] = 0;
+    strncpy(dir, dirname(buf), dirlen-1);
+    dir[dirlen-1] = 0;
+
+    for (k=0; k<i; k++) {
+        strncpy(buf, pending[list[k]].filename, sizeof(buf)-1);
+        buf[sizeof(buf)-1] = 0;
+        if (strcmp(dir, dirname(buf)) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+//
+// Commit closed files of the pending list: flush their data to disk,
+// rename them into place and sync every affected directory once.
+// Files still open stay pending.
+//
+static void commit_pending(void)
+{
+    char dir [1024];
+    int *list, n, i, fd;
+
+    list = malloc((npending + 1) * sizeof(int));
+    if (! list) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    for (n=0, i=0; i<npending; i++)
+        if (! pending[i].fp)
+            list[n++] = i;
+
+#ifndef MINGW32
+    // Flush data of every file, which is written by now.
+    for (i=0; i<n; i++) {
+        fd = open(pending[list[i]].tmpname, O_RDONLY);
+        if (fd < 0 || fsync(fd) < 0) {
+            perror(pending[list[i]].tmpname);
+            exit(-1);
+        }
+        close(fd);
+    }
+#endif
+
+    // Atomically replace the target files.
+    for (i=0; i<n; i++) {
+#ifdef MINGW32
+        unlink(pending[list[i]].filename);
+#endif
+        if (rename(pending[list[i]].tmpname, pending[list[i]].filename) < 0) {
+            perror(pending[list[i]].filename);
+            exit(-1);
+        }
+    }
+
+#ifndef MINGW32
+    // Make the renames durable: one fsync per directory.
+    for (i=0; i<n; i++) {
+        if (! first_in_directory(list, i, dir, sizeof(dir)))
+            continue;
+        fd = open(dir, O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+#endif
+
+    // Highest index first, as removal moves the last entry.
+    while (n > 0)
+        remove_pending(list[--n]);
+    free(list);
+}
+
+//
+// Create a file for writing.
+// Data go to a temporary file in the same directory,
+// which replaces the target on file_commit().
+// The name is unique like with mkstemp(), but the kernel applies
+// the umask: same permissions as fopen() would give.
+//
+FILE *file_create(const char *filename)
+{
+    static unsigned count;
+    pending_file_t *p;
+    char *tmpname;
+    int fd;
+
+    tmpname = malloc(strlen(filename) + 32);
+    if (! tmpname) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    do {
+        sprintf(tmpname, "%s.%d.%u", filename, (int) getpid(), count++);
+        fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+    } while (fd < 0 && errno == EEXIST);
+    if (fd < 0) {
+        perror(filename);
+        exit(-1);
+    }
+
+    p = add_pending(filename, tmpname);
+    p->fp = fdopen(fd, "wb");
+    if (! p->fp) {
+        perror(filename);
+        exit(-1);
+    }
+    return p->fp;
+}
+
+//
+// Close the file created by file_create().
+// Return the index in the pending list.
+//
+static int close_pending(FILE *fp)
+{
+    int i;
+
+    for (i=0; i<npending; i++) {
+        if (pending[i].fp == fp)
+            break;
+    }
+    if (i == npending) {
+        fprintf(stderr, "file_commit: Unknown file.\n");
+        exit(-1);
+    }
+    if (fflush(fp) != 0 || ferror(fp)) {
+        perror(pending[i].filename);
+        exit(-1);
+    }
+    fclose(fp);
+    pending[i].fp = 0;
+    return i;
+}
+
+//
+// Close the file created by file_create().
+// Outside of a batch, the file is made durable immediately.
+// Inside a batch, it is committed by file_batch_commit().
+// After file_handover(), the file is passed to the parent process.
+//
+void file_commit(FILE *fp)
+{
+    int i = close_pending(fp);
+
+    if (handover_fd >= 0) {
+        pending_file_t *p = &pending[i];
+
+        if (write(handover_fd, p->tmpname, strlen(p->tmpname) + 1) < 0 ||
+            write(handover_fd, p->filename, strlen(p->filename) + 1) < 0) {
+            perror("file_commit");
+            exit(-1);
+        }
+        remove_pending(i);
+        return;
+    }
+    if (batch_depth == 0)
+        commit_pending();
+}
+
+//
+// Close the file created by file_create() and rename it into place,
+// without waiting for the disk: for caches, which can be rebuilt.
+// Other pending files are not touched.
+//
+void file_commit_fast(FILE *fp)
+{
+    int i = close_pending(fp);
+
+#ifdef MINGW32
+    unlink(pending[i].filename);
+#endif
+    if (rename(pending[i].tmpname, pending[i].filename) < 0)
+        unlink(pending[i].tmpname);
+    remove_pending(i);
+}
+
+//
+// Start a batch of file writes.
+// Batches can be nested: only the outermost commit syncs to disk.
+//
+void file_batch_begin()
+{
+    batch_depth++;
+}
+
+//
+// Commit all files written since file_batch_begin(),
+// with one fsync per file and per directory.
+//
+void file_batch_commit()
+{
+    if (batch_depth > 0 && --batch_depth == 0)
+        commit_pending();
+}
+
+//
+// In a child process: pass files of file_commit() to the parent
+// through the descriptor, instead of committing them here.
+// Files pending in the parent are not ours: forget them,
+// so they are not removed at exit.
+//
+void file_handover(int fd)
+{
+    handover_fd = fd;
+    npending = 0;
+}
+
+//
+// In the parent: take the files passed by a child,
+// to be committed with the current batch.
+//
+void file_adopt(int fd)
+{
+    char *data = 0, *p, *tmpname;
+    int len = 0, n;
+
+    for (;;) {
+        data = realloc(data, len + 4096 + 1);
+        if (! data) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(-1);
+        }
+        n = read(fd, data + len, 4096);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    data[len] = 0;
+
+    // Records: temporary name and final name, each with a null byte.
+    for (p=data; p < data+len; ) {
+        tmpname = p;
+        p += strlen(p) + 1;
+        if (p >= data+len)
+            break;
+        add_pending(p, strdup(tmpname));
+        p += strlen(p) + 1;
+    }
+    free(data);
+    if (batch_depth == 0)
+        commit_pending();
+}
+
 //
 // Print data in hex format.
 //
@@ -164,6 +507,24 @@ int serial_open(const char *portname, int baud)
     int fd;
     unsigned baud_rate = (baud == 19200) ? B19200 : B9600;
 
+    // Virtual time and the simulated radio go together.
+    port_is_tcp = (strstr(portname, "://") != 0);
+    port_is_sim = (strncmp(portname, "sim:", 4) == 0);
+    if (clock_is_virtual() && ! port_is_sim) {
+        fprintf(stderr, "%s: Virtual time (option -V) is only for port 'sim:file.img'.\n",
+            portname);
+        exit(-1);
+    }
+    if (port_is_sim && ! clock_is_virtual()) {
+        fprintf(stderr, "%s: Simulated radio needs virtual time (option -V).\n",
+            portname);
+        exit(-1);
+    }
+    if (port_is_sim)
+        return standin_open(portname + 4, baud);
+    if (port_is_tcp)
+        return tcp_open(portname, baud);
+
     // Use non-block flag to ignore carrier (DCD).
     fd = open(portname, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (fd < 0) {
@@ -218,7 +579,15 @@ void serial_flush(int fd)
 #ifdef MINGW32
     PurgeComm((HANDLE) fd, PURGE_RXCLEAR);
 #else
-    tcflush(fd, TCIFLUSH);
+    if (port_is_tcp)
+        tcp_flush(fd);
+    else if (port_is_sim) {
+        unsigned char buf [256];
+
+        while (clock_wait_input(fd, 0) && read(fd, buf, sizeof(buf)) > 0)
+            continue;
+    } else
+        tcflush(fd, TCIFLUSH);
 #endif
 }
 
@@ -232,6 +601,14 @@ void serial_close(int fd)
     SetCommState((HANDLE) fd, &saved_mode);
     CloseHandle((HANDLE) fd);
 #else
+    if (port_is_tcp) {
+        tcp_close(fd);
+        return;
+    }
+    if (port_is_sim) {
+        standin_close(fd);
+        return;
+    }
     tcsetattr(fd, TCSANOW, &oldtio);
     close(fd);
 #endif
@@ -259,23 +636,14 @@ int serial_read(int fd, unsigned char *data, int len)
         data += nbytes;
     }
 #else
-    fd_set rset, wset, xset;
     int nbytes, len0 = len;
 
-    for (;;) {
-        // Initialize file descriptor sets.
-        FD_ZERO(&rset);
-        FD_ZERO(&wset);
-        FD_ZERO(&xset);
-        FD_SET(fd, &rset);
-
-        // Set timeout to 100 msec.
-        struct timeval timo;
-        timo.tv_sec = 0;
-        timo.tv_usec = 200000;
+    if (port_is_tcp)
+        return tcp_read(fd, data, len);
 
+    for (;;) {
         // Wait for input to become ready or until the time out.
-        if (select(fd + 1, &rset, &wset, &xset, &timo) != 1)
+        if (! clock_wait_input(fd, 200000))
             return 0;
 
         nbytes = read(fd, data, len);
@@ -302,6 +670,10 @@ void serial_write(int fd, const void *data, int len)
 
     WriteFile((HANDLE)fd, data, len, &count, 0);
 #else
+    if (port_is_tcp) {
+        tcp_write(fd, data, len);
+        return;
+    }
     if (write(fd, data, len) != len) {
         perror("Serial port");
         exit(-1);
@@ -314,11 +686,24 @@ void serial_write(int fd, const void *data, int len)
 //
 void mdelay(unsigned msec)
 {
-#ifdef MINGW32
-    Sleep(msec);
-#else
-    usleep(msec * 1000);
-#endif
+    clock_sleep(msec * 1000LL);
+}
+
+//
+// Compute 64-bit FNV-1a hash of the data.
+// Pass the previous result as seed to hash a sequence of blocks,
+// or 0 to start a new hash.
+//
+unsigned long long hash_bytes(const void *data, int nbytes, unsigned long long seed)
+{
+    const unsigned char *p = data;
+    unsigned long long h = seed ? seed : 0xcbf29ce484222325ULL;
+
+    while (nbytes-- > 0) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
 }
 
 //
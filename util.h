@@ -96,16 +96,100 @@ int serial_read(int fd, unsigned char *data, int len);
 //
 void serial_write(int fd, const void *data, int len);
 
+//
+// Serial port over TCP: tcp://host:port or rfc2217://host:port.
+//
+int tcp_open(const char *url, int baud);
+void tcp_close(int fd);
+void tcp_flush(int fd);
+int tcp_read(int fd, unsigned char *data, int len);
+void tcp_write(int fd, const void *data, int len);
+
 //
 // Delay in milliseconds.
 //
 void mdelay(unsigned msec);
 
+//
+// Clock of the program: every sleep, timeout and timestamp goes through it.
+// Real time by default.  In virtual time, the clock jumps to the nearest
+// deadline as soon as every thread taking part is waiting in it.
+//
+long long clock_usec(void);
+void clock_sleep(long long usec);
+
+//
+// Wait for input on the file descriptor, up to the given time in microseconds.
+// Return 1 when input is ready, 0 on timeout.
+//
+int clock_wait_input(int fd, long long usec);
+
+//
+// Switch to virtual time; add a new thread to it, by the creator;
+// remove the calling thread when it finishes.
+//
+void clock_virtual(void);
+void clock_attach(void);
+void clock_detach(void);
+
+//
+// Is the clock virtual?  In virtual time: is any thread waiting
+// for input on the file descriptor?
+//
+int clock_is_virtual(void);
+int clock_input_wanted(int fd);
+
+//
+// Radio simulated in this process, for serial port sim:file.img,
+// in virtual time.  It sends the image when the tool waits for data,
+// and receives and saves the image when the tool sends.
+//
+int standin_open(const char *filename, int baud);
+void standin_close(int fd);
+
+//
+// Create a file for writing.
+// The target is replaced atomically on file_commit().
+//
+FILE *file_create(const char *filename);
+
+//
+// Close the file created by file_create().
+// Outside of a batch, sync it to disk and rename into place.
+//
+void file_commit(FILE *fp);
+
+//
+// Close the file and rename it into place without syncing,
+// for caches which can be rebuilt.
+//
+void file_commit_fast(FILE *fp);
+
+//
+// Group commit: defer syncing of files until file_batch_commit(),
+// then flush them with one fsync per file and per directory.
+//
+void file_batch_begin(void);
+void file_batch_commit(void);
+
+//
+// Files written by child processes: the child passes its commits
+// through a pipe, and the parent adopts them into its own batch.
+//
+void file_handover(int fd);
+void file_adopt(int fd);
+
 //
 // Check for a regular file.
 //
 int is_file(char *filename);
 
+//
+// Compute 64-bit FNV-1a hash of the data.
+// Seed is a previous result for chaining, or 0.
+//
+unsigned long long hash_bytes(const void *data, int nbytes, unsigned long long seed);
+
 //
 // Convert 32-bit value from binary coded decimal
 // to integer format (8 digits).
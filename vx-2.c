@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include "radio.h"
 #include "util.h"
+#include "trace.h"
 
 #define NCHAN           1000
 #define NBANKS          20
@@ -169,6 +170,17 @@ static void vx2_print_version(FILE *out)
     // Nothing to print.
 }
 
+//
+// Pause before the next block, for the radio to keep up.
+//
+static void pace(int usec)
+{
+    TRACE1(pace, usec);
+    radio_timeline_begin("pace", 0);
+    clock_sleep(usec);
+    radio_timeline_end();
+}
+
 //
 // Read block of data, up to 64 bytes.
 // When start==0, return non-zero on success or 0 when empty.
@@ -183,38 +195,33 @@ static int read_block(int fd, int start, unsigned char *data, int datalen)
 again:
     // Read chunk of data.
     nbytes = (datalen < 64) ? datalen : 64;
+    radio_health_check();
     len = serial_read(fd, data, nbytes);
     if (len != nbytes) {
         if (start == 0)
             return 0;
-        fprintf(stderr, "Reading block 0x%04x: got only %d bytes.\n", start, len);
-        exit(-1);
+        radio_message(0, "Reading block 0x%04x: got only %d bytes.\n", start, len);
+        radio_health_event(HEALTH_TIMEOUT);
+        radio_fail();
     }
+    TRACE2(block_rx, start, nbytes);
 
     if (need_ack) {
         // Send acknowledge.
         serial_write(fd, "\x06", 1);
-        if (serial_read(fd, &reply, 1) != 1) {
-            fprintf(stderr, "No acknowledge after block 0x%04x.\n", start);
-            exit(-1);
+        if (radio_read_ack(fd, &reply) != 1) {
+            radio_message(0, "No acknowledge after block 0x%04x.\n", start);
+            radio_fail();
         }
         if (reply != 0x06) {
-            fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", start, reply);
-            exit(-1);
+            radio_message(0, "Bad acknowledge after block 0x%04x: %02x\n", start, reply);
+            radio_fail();
         }
+        TRACE2(ack, start, reply);
     }
+    radio_fingerprint_block(start, data, nbytes);
 
-    if (serial_verbose) {
-        printf("# Read 0x%04x: ", start);
-        print_hex(data, nbytes);
-        printf("\n");
-    } else {
-        ++radio_progress;
-        if (radio_progress % 16 == 0) {
-            fprintf(stderr, "#");
-            fflush(stderr);
-        }
-    }
+    radio_block(start, 0, data, nbytes);
 
     if (nbytes < datalen) {
         // Next chunk.
@@ -241,44 +248,40 @@ again:
     // Write chunk of data.
     nbytes = (datalen < 64) ? datalen : 64;
     serial_write(fd, data, nbytes);
+    TRACE2(block_tx, start, nbytes);
 
     // Get echo.
     len = serial_read(fd, reply, nbytes);
     if (len != nbytes) {
-        fprintf(stderr, "! Echo for block 0x%04x: got only %d bytes.\n", start, len);
+        radio_message(0, "! Echo for block 0x%04x: got only %d bytes.\n", start, len);
+        radio_health_event(HEALTH_ECHO);
         return 0;
     }
+    if (memcmp(reply, data, nbytes) != 0)
+        radio_health_event(HEALTH_ECHO);
+    TRACE2(echo, start, len);
 
     if (need_ack) {
         // Get acknowledge.
-        if (serial_read(fd, reply, 1) != 1) {
-            fprintf(stderr, "! No acknowledge after block 0x%04x.\n", start);
+        if (radio_read_ack(fd, reply) != 1) {
+            radio_message(0, "! No acknowledge after block 0x%04x.\n", start);
             return 0;
         }
         if (reply[0] != 0x06) {
-            fprintf(stderr, "! Bad acknowledge after block 0x%04x: %02x\n", start, reply[0]);
+            radio_message(0, "! Bad acknowledge after block 0x%04x: %02x\n", start, reply[0]);
             return 0;
         }
+        TRACE2(ack, start, reply[0]);
     }
 
-    if (serial_verbose) {
-        printf("# Write 0x%04x: ", start);
-        print_hex(data, nbytes);
-        printf("\n");
-    } else {
-        ++radio_progress;
-        if (radio_progress % 16 == 0) {
-            fprintf(stderr, "#");
-            fflush(stderr);
-        }
-    }
+    radio_block(start, 1, data, nbytes);
 
     if (nbytes < datalen) {
         // Next chunk.
         start += nbytes;
         data += nbytes;
         datalen -= nbytes;
-        usleep(60000);
+        pace(60000);
         goto again;
     }
     return 1;
@@ -292,49 +295,54 @@ static void vx2_download()
     int addr, sum;
 
     if (serial_verbose)
-        fprintf(stderr, "\nPlease follow the procedure:\n");
+        radio_message(0, "\nPlease follow the procedure:\n");
     else
-        fprintf(stderr, "please follow the procedure.\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "1. Power Off the VX-2.\n");
-    fprintf(stderr, "2. Hold down the F/W key and Power On the VX-2. \n");
-    fprintf(stderr, "   CLONE wil appear on the display.\n");
-    fprintf(stderr, "3. Press the BAND key until the radio starts to send.\n");
-    fprintf(stderr, "-- Or enter ^C to abort the memory read.\n");
+        radio_message(0, "please follow the procedure.\n");
+    radio_message(0, "\n");
+    radio_message(0, "1. Power Off the VX-2.\n");
+    radio_message(0, "2. Hold down the F/W key and Power On the VX-2. \n");
+    radio_message(0, "   CLONE wil appear on the display.\n");
+    radio_message(0, "3. Press the BAND key until the radio starts to send.\n");
+    radio_message(0, "-- Or enter ^C to abort the memory read.\n");
 again:
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Waiting for data... ");
-    fflush(stderr);
+    radio_message(0, "\n");
+    radio_message(0, "Waiting for data... ");
 
     // Wait for the first 10 bytes.
+    radio_timeline_phase("wait for data");
     while (read_block(radio_port, 0, &radio_mem[0], 10) == 0)
         continue;
 
     // Wait for the next 8 bytes.
+    radio_timeline_phase("header blocks");
     while (read_block(radio_port, 10, &radio_mem[10], 8) == 0)
         continue;
 
     // Get the rest of data, and checksum.
+    radio_timeline_phase("bulk blocks");
     read_block(radio_port, 18, &radio_mem[18], MEMSZ - 18 + 1);
 
     // Verify the checksum.
+    radio_timeline_phase("checksum");
     sum = 0;
     for (addr=0; addr<MEMSZ; addr++)
         sum += radio_mem[addr];
     sum &= 0xff;
+    TRACE2(checksum, sum, radio_mem[MEMSZ]);
     if (sum != radio_mem[MEMSZ]) {
         if (serial_verbose) {
-            printf("Bad checksum = %02x, expected %02x\n", sum, radio_mem[MEMSZ]);
-            fprintf(stderr, "BAD CHECKSUM!\n");
+            radio_message(1, "Bad checksum = %02x, expected %02x\n", sum, radio_mem[MEMSZ]);
+            radio_message(0, "BAD CHECKSUM!\n");
         } else
-            fprintf(stderr, "[BAD CHECKSUM]\n");
-        fprintf(stderr, "Please, repeat the procedure:\n");
-        fprintf(stderr, "Press and hold the PTT switch until the radio starts to send.\n");
-        fprintf(stderr, "Or enter ^C to abort the memory read.\n");
+            radio_message(0, "[BAD CHECKSUM]\n");
+        radio_message(0, "Please, repeat the procedure:\n");
+        radio_message(0, "Press and hold the PTT switch until the radio starts to send.\n");
+        radio_message(0, "Or enter ^C to abort the memory read.\n");
+        radio_health_event(HEALTH_RETRY);
         goto again;
     }
     if (serial_verbose)
-        printf("Checksum = %02x (OK)\n", radio_mem[MEMSZ]);
+        radio_message(1, "Checksum = %02x (OK)\n", radio_mem[MEMSZ]);
 }
 
 //
@@ -343,58 +351,79 @@ again:
 static void vx2_upload(int cont_flag)
 {
     int addr, sum;
-    char buf[80];
 
     if (serial_verbose)
-        fprintf(stderr, "\nPlease follow the procedure:\n");
+        radio_message(0, "\nPlease follow the procedure:\n");
     else
-        fprintf(stderr, "please follow the procedure.\n");
-    fprintf(stderr, "\n");
+        radio_message(0, "please follow the procedure.\n");
+    radio_message(0, "\n");
     if (cont_flag) {
-        fprintf(stderr, "1. Press the V/M key until the radio starts to receive.\n");
-        fprintf(stderr, "   WAIT will appear on the display.\n");
-        fprintf(stderr, "2. Press <Enter> to continue.\n");
+        radio_message(0, "1. Press the V/M key until the radio starts to receive.\n");
+        radio_message(0, "   WAIT will appear on the display.\n");
+        radio_message(0, "2. Press <Enter> to continue.\n");
     } else {
-        fprintf(stderr, "1. Power Off the VX-2.\n");
-        fprintf(stderr, "2. Hold down the F/W key and Power On the VX-2. \n");
-        fprintf(stderr, "   CLONE will appear on the display.\n");
-        fprintf(stderr, "3. Press the V/M key until the radio starts to receive.\n");
-        fprintf(stderr, "4. Press <Enter> to continue.\n");
+        radio_message(0, "1. Power Off the VX-2.\n");
+        radio_message(0, "2. Hold down the F/W key and Power On the VX-2. \n");
+        radio_message(0, "   CLONE will appear on the display.\n");
+        radio_message(0, "3. Press the V/M key until the radio starts to receive.\n");
+        radio_message(0, "4. Press <Enter> to continue.\n");
     }
-    fprintf(stderr, "-- Or enter ^C to abort the memory write.\n");
+    radio_message(0, "-- Or enter ^C to abort the memory write.\n");
 again:
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Press <Enter> to continue: ");
-    fflush(stderr);
+    radio_message(0, "\n");
+    radio_message(0, "Press <Enter> to continue: ");
+    radio_timeline_phase("wait for operator");
     serial_flush(radio_port);
-    if (! fgets(buf, sizeof(buf), stdin))
-	/*ignore*/;
-    fprintf(stderr, "Sending data... ");
+    radio_wait_enter();
+    radio_message(0, "Sending data... ");
     serial_flush(radio_port);
-    fflush(stderr);
 
+    radio_timeline_phase("header blocks");
     if (! write_block(radio_port, 0, &radio_mem[0], 10)) {
-error:  fprintf(stderr, "\nPlease, repeat the procedure:\n");
-        fprintf(stderr, "1. Press the V/M key until the radio starts to receive.\n");
-        fprintf(stderr, "2. Press <Enter> to continue.\n");
-        fprintf(stderr, "-- Or enter ^C to abort the memory write.\n");
+error:  radio_timeline_phase("retry");
+        radio_message(0, "\nPlease, repeat the procedure:\n");
+        radio_message(0, "1. Press the V/M key until the radio starts to receive.\n");
+        radio_message(0, "2. Press <Enter> to continue.\n");
+        radio_message(0, "-- Or enter ^C to abort the memory write.\n");
+        radio_health_event(HEALTH_RETRY);
         goto again;
     }
-    usleep(500000);
+    pace(500000);
     if (! write_block(radio_port, 10, &radio_mem[10], 8))
         goto error;
 
     // Compute the checksum.
+    radio_timeline_phase("checksum");
     sum = 0;
     for (addr=0; addr<MEMSZ; addr++)
         sum += radio_mem[addr];
     radio_mem[MEMSZ] = sum;
+    TRACE2(checksum, sum & 0xff, radio_mem[MEMSZ]);
 
-    usleep(500000);
+    radio_timeline_phase("bulk blocks");
+    pace(500000);
     if (! write_block(radio_port, 18, &radio_mem[18], MEMSZ - 18 + 1))
         goto error;
 
-    usleep(200000);
+    pace(200000);
+}
+
+//
+// Count traffic of download or upload, for estimation of session time.
+// Only the first two blocks are acknowledged.  On upload, every chunk
+// of the bulk block waits for the echo, and is followed by a pause.
+//
+static void vx2_wire(int upload, radio_wire_t *w)
+{
+    int nchunks = (MEMSZ - 18 + 1 + 63) / 64;
+
+    w->bytes = MEMSZ + 1 + 2;
+    w->handshakes = 2;
+    w->pause_usec = 0;
+    if (upload) {
+        w->handshakes += nchunks;
+        w->pause_usec = 500000 + 500000 + 200000 + (nchunks - 1) * 60000;
+    }
 }
 
 //
@@ -417,85 +446,30 @@ static int iround(double x)
 }
 
 //
-// Convert squelch string to CTCSS tone index.
-// Return -1 on error.
-// Format: nnn.n
-//
-static int encode_tone(char *str)
-{
-    unsigned val;
-
-    // CTCSS tone
-    float hz;
-    if (sscanf(str, "%f", &hz) != 1)
-        return -1;
-
-    // Round to integer.
-    val = iround(hz * 10.0);
-    if (val < 0x0258)
-        return -1;
-
-    // Find a valid index in CTCSS table.
-    int i;
-    for (i=0; i<NCTCSS; i++)
-        if (CTCSS_TONES[i] == val)
-            return i;
-    return -1;
-}
-
-//
-// Convert squelch string to DCS code index.
-// Return -1 on error.
-// Format: Dnnn
-//
-static int encode_dcs(char *str)
-{
-    unsigned val;
-
-    // DCS tone
-    if (sscanf(++str, "%u", &val) != 1)
-        return -1;
-
-    // Find a valid index in DCS table.
-    int i;
-    for (i=0; i<NDCS; i++)
-        if (DCS_CODES[i] == val)
-            return i;
-    return -1;
-}
-
-//
-// Convert squelch strings to tmode value, tone index and dcs index.
-//
-static int encode_squelch(char *rx, char *tx, int *tone, int *dcs)
-{
-    int rx_tone = -1, tx_tone = -1, tx_dcs = -1;
-
-    if (*tx == 'D' || *tx == 'd') {             // Transmit DCS code
-        tx_dcs = encode_dcs(tx);
-    } else if (*tx >= '0' && *tx <= '9') {      // Transmit CTCSS tone
-        tx_tone = encode_tone(tx);
-    }
-
-    if (*rx >= '0' && *rx <= '9') {             // Receive CTCSS tone
-        rx_tone = encode_tone(rx);
-    }
-
-    // Encode tmode.
-    *tone = TONE_DEFAULT;
-    *dcs = 0;
-    if (tx_dcs >= 0) {
-        *dcs = tx_dcs;
-        return T_DTCS;
-    }
-    if (tx_tone >= 0) {
-        *tone = tx_tone;
-        if (rx_tone < 0)
-            return T_TONE;
-        return T_TSQL;
-    }
-    return T_OFF;
-}
+// Squelch modes: kinds of receive and transmit squelch for every tmode,
+// and tmode for every combination of squelch values.
+// Receive DCS and reverse tone are not supported.
+//
+static const radio_squelch_t SQUELCH = {
+    4,
+    //  OFF     TONE    TSQL    DTCS
+    { Q_NONE, Q_NONE, Q_CTCS, Q_DCS },                  // Receive
+    { Q_NONE, Q_CTCS, Q_CTCS, Q_DCS },                  // Transmit
+    { 0,      0,      0,      0     },                  // Reverse
+    { SQ_DEFAULT, SQ_TX, SQ_TX, SQ_DEFAULT },           // Tone
+    { SQ_DEFAULT, SQ_DEFAULT, SQ_DEFAULT, SQ_TX },      // DCS
+    {
+        // Receive none, tone, DCS; transmit none, tone, DCS.
+        { {0}, { 0, T_OFF, T_TONE, T_DTCS },
+               { 0, T_OFF, T_TSQL, T_DTCS },
+               { 0, T_OFF, T_TONE, T_DTCS } },
+        // Reverse receive tone.
+        { {0}, { 0, T_OFF, T_TONE, T_DTCS },
+               { 0, T_OFF, T_TONE, T_DTCS },
+               { 0, T_OFF, T_TONE, T_DTCS } },
+    },
+    TONE_DEFAULT,
+};
 
 //
 // Convert a 3-byte frequency value from binary coded decimal
@@ -596,6 +570,7 @@ static void setup_bank(int bank_index, int chan_index)
     // Find first empty slot.
     for (n=0; n<100; n++) {
         if (data[n] == 0xffff) {
+            radio_journal(&data[n], 2);
             data[n] = big_endian_16(chan_index);
             return;
         }
@@ -670,6 +645,43 @@ static void encode_name(uint8_t *internal, char *name)
     }
 }
 
+//
+// Map of used channels and PMS records.
+//
+#define NSLOTS          (NCHAN + NPMS*2)
+
+static radio_slots_t used_slots;
+
+//
+// Build the map of used slots from flag nibbles, when the image
+// was replaced.  Edits keep the map up to date.
+//
+static void scan_slots()
+{
+    int i;
+
+    if (used_slots.valid && used_slots.epoch == radio_mem_epoch)
+        return;
+    memset(&used_slots, 0, sizeof(used_slots));
+    for (i=0; i<NSLOTS; i+=2) {
+        int pair = radio_mem[OFFSET_FLAGS + i/2];
+
+        radio_slots_set(&used_slots, i, pair & FLAG_VALID);
+        radio_slots_set(&used_slots, i+1, pair >> 4 & FLAG_VALID);
+    }
+    used_slots.epoch = radio_mem_epoch;
+    used_slots.valid = 1;
+}
+
+//
+// Mark a range of slots as free, after flags are cleared.
+//
+static void clear_slots(int first, int n)
+{
+    while (n-- > 0)
+        radio_slots_set(&used_slots, first++, 0);
+}
+
 //
 // Get channel flags.
 //
@@ -690,8 +702,10 @@ static void set_flags(int i, int flags)
     unsigned char *ptr = &radio_mem[OFFSET_FLAGS + i/2];
     int shift = (i & 1) * 4;
 
+    radio_journal(ptr, 1);
     *ptr &= ~(0xf << shift);
     *ptr |= flags << shift;
+    radio_slots_set(&used_slots, i, flags & FLAG_VALID);
 }
 
 //
@@ -741,19 +755,8 @@ static void decode_channel(int i, int seek, char *name,
     }
 
     // Decode squelch modes.
-    switch (ch->tmode) {
-    case T_TONE:
-        *tx_ctcs = CTCSS_TONES[ch->tone];
-        break;
-    case T_TSQL:
-        *tx_ctcs = CTCSS_TONES[ch->tone];
-        *rx_ctcs = CTCSS_TONES[ch->tone];
-        break;
-    case T_DTCS:
-        *tx_dcs = DCS_CODES[ch->dcs];
-        *rx_dcs = DCS_CODES[ch->dcs];
-        break;
-    }
+    radio_decode_squelch(&SQUELCH, ch->tmode, ch->tone, ch->dcs,
+        rx_ctcs, tx_ctcs, rx_dcs, tx_dcs);
 
     // Other parameters.
     *power = ch->power;
@@ -773,6 +776,7 @@ static void setup_channel(int i, char *name, double rx_mhz, double tx_mhz,
     memory_channel_t *ch = i + (memory_channel_t*) &radio_mem[OFFSET_CHANNELS];
     int flags = FLAG_VALID | FLAG_UNMASKED;
 
+    radio_journal(ch, sizeof(*ch));
     hz_to_freq(iround(rx_mhz * 1000000.0), ch->rxfreq);
 
     int offset_khz = iround((tx_mhz - rx_mhz) * 1000.0);
@@ -827,6 +831,7 @@ static void setup_home(int band, double rx_mhz, double tx_mhz,
     int index = (band <= 4) ? band-1 : band;
     memory_channel_t *ch = index + (memory_channel_t*) &radio_mem[OFFSET_HOME];
 
+    radio_journal(ch, sizeof(*ch));
     hz_to_freq(iround(rx_mhz * 1000000.0), ch->rxfreq);
 
     int offset_khz = iround((tx_mhz - rx_mhz) * 1000.0);
@@ -868,6 +873,7 @@ static void setup_vfo(int band, double rx_mhz, double tx_mhz,
     int index = (band <= 4) ? band-1 : band;
     memory_channel_t *ch = index + (memory_channel_t*) &radio_mem[OFFSET_VFO];
 
+    radio_journal(ch, sizeof(*ch));
     hz_to_freq(iround(rx_mhz * 1000000.0), ch->rxfreq);
 
     int offset_khz = iround((tx_mhz - rx_mhz) * 1000.0);
@@ -909,6 +915,7 @@ static void setup_pms(int i, double mhz)
 {
     memory_channel_t *ch = i + (memory_channel_t*) &radio_mem[OFFSET_PMS];
 
+    radio_journal(ch, sizeof(*ch));
     hz_to_freq(iround(mhz * 1000000.0), ch->rxfreq);
 
     ch->offset[0] = ch->offset[1] = ch->offset[2] = 0;
@@ -972,12 +979,43 @@ static void print_squelch(FILE *out, int ctcs, int dcs)
     else              fprintf(out, "   - ");
 }
 
+//
+// Print a row of the channel table.
+// Disabled channel is skipped.
+//
+static void print_channel(FILE *out, int i)
+{
+    int rx_hz, tx_hz, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs;
+    int power, scan, amfm, step;
+    char name[17];
+
+    decode_channel(i, OFFSET_CHANNELS, name, &rx_hz, &tx_hz, &rx_ctcs, &tx_ctcs,
+        &rx_dcs, &tx_dcs, &power, &scan, &amfm, &step);
+    if (rx_hz == 0) {
+        // Channel is disabled
+        return;
+    }
+    TRACE2(row_render, 'C', i);
+
+    fprintf(out, "%5d   %-7s %7.3f  ", i+1, name[0] ? name : "-", rx_hz / 1000000.0);
+    print_offset(out, rx_hz, tx_hz);
+    fprintf(out, " ");
+    print_squelch(out, rx_ctcs, rx_dcs);
+    fprintf(out, "   ");
+    print_squelch(out, tx_ctcs, tx_dcs);
+
+    fprintf(out, "   %-4s  %-10s %s\n", POWER_NAME[power],
+        MOD_NAME[amfm], SCAN_NAME[scan]);
+}
+
 //
 // Print full information about the device configuration.
 //
 static void vx2_print_config(FILE *out, int verbose)
 {
-    int i;
+    int i, s;
+
+    scan_slots();
 
     //
     // Radio identification and hardware options.
@@ -1004,28 +1042,9 @@ static void vx2_print_config(FILE *out, int verbose)
         fprintf(out, "#\n");
     }
     fprintf(out, "Channel Name    Receive  Transmit R-Squel T-Squel Power Modulation Scan\n");
-    for (i=0; i<NCHAN; i++) {
-        int rx_hz, tx_hz, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs;
-        int power, scan, amfm, step;
-        char name[17];
-
-        decode_channel(i, OFFSET_CHANNELS, name, &rx_hz, &tx_hz, &rx_ctcs, &tx_ctcs,
-            &rx_dcs, &tx_dcs, &power, &scan, &amfm, &step);
-        if (rx_hz == 0) {
-            // Channel is disabled
-            continue;
-        }
-
-        fprintf(out, "%5d   %-7s %7.3f  ", i+1, name[0] ? name : "-", rx_hz / 1000000.0);
-        print_offset(out, rx_hz, tx_hz);
-        fprintf(out, " ");
-        print_squelch(out, rx_ctcs, rx_dcs);
-        fprintf(out, "   ");
-        print_squelch(out, tx_ctcs, tx_dcs);
-
-        fprintf(out, "   %-4s  %-10s %s\n", POWER_NAME[power],
-            MOD_NAME[amfm], SCAN_NAME[scan]);
-    }
+    for (i=radio_slots_next(&used_slots, 0, NCHAN); i<NCHAN;
+         i=radio_slots_next(&used_slots, i+1, NCHAN))
+        print_channel(out, i);
     if (verbose)
         print_squelch_tones(out, 1);
 
@@ -1143,10 +1162,14 @@ static void vx2_print_config(FILE *out, int verbose)
         fprintf(out, "#\n");
     }
     fprintf(out, "PMS     Lower    Upper\n");
-    for (i=0; i<NPMS; i++) {
+    for (s=radio_slots_next(&used_slots, NCHAN, NSLOTS); s<NSLOTS;
+         s=radio_slots_next(&used_slots, NCHAN + (i+1)*2, NSLOTS)) {
         int lower_hz, upper_hz, tx_hz, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs;
         int power, scan, amfm, step;
 
+        // Both records of the pair.
+        i = (s - NCHAN) / 2;
+
         decode_channel(i*2, OFFSET_PMS, 0, &lower_hz, &tx_hz, &rx_ctcs, &tx_ctcs,
             &rx_dcs, &tx_dcs, &power, &scan, &amfm, &step);
         decode_channel(i*2+1, OFFSET_PMS, 0, &upper_hz, &tx_hz, &rx_ctcs, &tx_ctcs,
@@ -1166,6 +1189,68 @@ static void vx2_print_config(FILE *out, int verbose)
     }
 }
 
+//
+// Print memory channels matching the query.
+// Predicates are compiled into checks of raw channel data,
+// only matching channels are decoded.
+// Return the number of matches.
+//
+static int vx2_query(FILE *out, const radio_query_t *q)
+{
+    memory_channel_t *chan = (memory_channel_t*) &radio_mem[OFFSET_CHANNELS];
+    unsigned tmodes, powers, mods, scans, flagset, lo = 0, hi = ~0;
+    int tone, dcs, f, i, nmatch = 0;
+    short match[NCHAN+1];
+
+    if (q->rx_lo) {
+        uint8_t bcd[3];
+
+        // BCD digits compare as the frequency value.
+        hz_to_freq(q->rx_lo, bcd);
+        lo = bcd[0] << 16 | bcd[1] << 8 | bcd[2];
+        hz_to_freq(q->rx_hi, bcd);
+        hi = bcd[0] << 16 | bcd[1] << 8 | bcd[2];
+    }
+    tmodes = radio_query_tmodes(q, &SQUELCH, &tone, &dcs);
+    powers = radio_query_names(q->power, "power", POWER_NAME, 4);
+    mods   = radio_query_names(q->mod, "modulation", MOD_NAME, 5);
+    scans  = radio_query_names(q->scan, "scan mode", SCAN_NAME, 4);
+
+    // Set of flag nibbles for valid channels with matching scan mode.
+    flagset = 0;
+    for (f=0; f<16; f++) {
+        int scan = (f & FLAG_PSKIP) ? SCAN_PREFERENTIAL :
+                   (f & FLAG_SKIP)  ? SCAN_SKIP :
+                                      SCAN_NORMAL;
+        if ((f & FLAG_VALID) && (scans >> scan & 1))
+            flagset |= 1 << f;
+    }
+
+    // Check used channels without branches.
+    scan_slots();
+    for (i=radio_slots_next(&used_slots, 0, NCHAN); i<NCHAN;
+         i=radio_slots_next(&used_slots, i+1, NCHAN)) {
+        memory_channel_t *ch = &chan[i];
+        unsigned key   = ch->rxfreq[0] << 16 | ch->rxfreq[1] << 8 | ch->rxfreq[2];
+        unsigned flags = radio_mem[OFFSET_FLAGS + i/2] >> ((i & 1) * 4) & 15;
+        unsigned mod   = ch->isnarrow ? MOD_NFM : ch->amfm;
+
+        match[nmatch] = i;
+        nmatch += (flagset >> flags) & (key >= lo) & (key <= hi) &
+                  (tmodes >> ch->tmode) &
+                  (tone < 0 || ch->tone == tone) &
+                  (dcs < 0 || ch->dcs == dcs) &
+                  (powers >> ch->power) & (mods >> mod) & 1;
+    }
+    if (nmatch == 0)
+        return 0;
+
+    fprintf(out, "Channel Name    Receive  Transmit R-Squel T-Squel Power Modulation Scan\n");
+    for (i=0; i<nmatch; i++)
+        print_channel(out, match[i]);
+    return nmatch;
+}
+
 //
 // Read memory image from the binary file.
 //
@@ -1204,6 +1289,7 @@ static void vx2_parse_parameter(char *param, char *value)
             fprintf(stderr, "Wrong value: %s = %s\n", param, value);
             return;
         }
+        radio_journal(&radio_mem[10], 4);
         radio_mem[10] = a;
         radio_mem[11] = b;
         radio_mem[12] = c;
@@ -1225,6 +1311,26 @@ static int is_valid_frequency(double mhz)
     return 0;
 }
 
+//
+// Erase all memory channels.
+//
+static void erase_channels()
+{
+    radio_memset(&radio_mem[OFFSET_CHANNELS], 0xff, NCHAN * sizeof(memory_channel_t));
+    radio_memset(&radio_mem[OFFSET_FLAGS], 0, NCHAN/2);
+    clear_slots(0, NCHAN);
+}
+
+//
+// Erase one memory channel.
+//
+static void clear_channel(int i)
+{
+    radio_memset(&radio_mem[OFFSET_CHANNELS + i * sizeof(memory_channel_t)], 0xff,
+        sizeof(memory_channel_t));
+    set_flags(i, 0);
+}
+
 //
 // Parse one line of memory channel table.
 // Start_flag is 1 for the first table row.
@@ -1251,6 +1357,13 @@ static int parse_channel(int first_row, char *line)
         return 0;
     }
 
+    if (rxfreq_str[0] == '-' && rxfreq_str[1] == 0) {
+        // Empty channel.
+        if (first_row == ROW_FIRST)
+            erase_channels();
+        clear_channel(num-1);
+        return 1;
+    }
     if (sscanf(rxfreq_str, "%lf", &rx_mhz) != 1 ||
         ! is_valid_frequency(rx_mhz)) {
         fprintf(stderr, "Bad receive frequency.\n");
@@ -1268,7 +1381,7 @@ badtx:      fprintf(stderr, "Bad transmit frequency.\n");
         if (! is_valid_frequency(tx_mhz))
             goto badtx;
     }
-    tmode = encode_squelch(rq_str, tq_str, &tone, &dcs);
+    tmode = radio_encode_squelch(&SQUELCH, rq_str, tq_str, &tone, &dcs);
 
     if (strcasecmp("High", power_str) == 0) {
         power = PWR_HIGH;
@@ -1306,10 +1419,9 @@ badtx:      fprintf(stderr, "Bad transmit frequency.\n");
         return 0;
     }
 
-    if (first_row) {
+    if (first_row == ROW_FIRST) {
         // On first entry, erase the channel table.
-        memset(&radio_mem[OFFSET_CHANNELS], 0xff, NCHAN * sizeof(memory_channel_t));
-        memset(&radio_mem[OFFSET_FLAGS], 0, NCHAN/2);
+        erase_channels();
     }
 
     setup_channel(num-1, name_str, rx_mhz, tx_mhz,
@@ -1356,7 +1468,7 @@ badtx:      fprintf(stderr, "Bad transmit frequency.\n");
         if (! is_valid_frequency(tx_mhz))
             goto badtx;
     }
-    tmode = encode_squelch(rq_str, tq_str, &tone, &dcs);
+    tmode = radio_encode_squelch(&SQUELCH, rq_str, tq_str, &tone, &dcs);
 
     if (strcasecmp("High", power_str) == 0) {
         power = PWR_HIGH;
@@ -1449,7 +1561,7 @@ badtx:      fprintf(stderr, "Bad transmit frequency.\n");
         if (! is_valid_frequency(tx_mhz))
             goto badtx;
     }
-    tmode = encode_squelch(rq_str, tq_str, &tone, &dcs);
+    tmode = radio_encode_squelch(&SQUELCH, rq_str, tq_str, &tone, &dcs);
 
     if (strcasecmp("High", power_str) == 0) {
         power = PWR_HIGH;
@@ -1532,16 +1644,22 @@ static int parse_pms(int first_row, char *line)
         return 0;
     }
 
-    if (first_row) {
+    if (first_row == ROW_FIRST) {
         // On first entry, erase the PMS table.
-        memset(&radio_mem[OFFSET_PMS], 0xff, NPMS * 2 * sizeof(memory_channel_t));
-        memset(&radio_mem[OFFSET_FLAGS] + NCHAN/2, 0, NPMS);
+        radio_memset(&radio_mem[OFFSET_PMS], 0xff, NPMS * 2 * sizeof(memory_channel_t));
+        radio_memset(&radio_mem[OFFSET_FLAGS] + NCHAN/2, 0, NPMS);
+        clear_slots(NCHAN, NPMS*2);
     }
     setup_pms(num*2 - 2, lower_mhz);
     setup_pms(num*2 - 1, upper_mhz);
     return 1;
 }
 
+//
+// Banks already listed in the current fragment.
+//
+static unsigned banks_replaced;
+
 //
 // Parse one line of Banks table.
 // Return 0 on failure.
@@ -1560,12 +1678,21 @@ static int parse_banks(int first_row, char *line)
         return 0;
     }
 
-    if (first_row) {
+    if (first_row == ROW_FIRST) {
         // On first entry, erase the Banks table.
-        memset(&radio_mem[OFFSET_BANKS], 0xff, NBANKS * 200);
-        memset(&radio_mem[OFFSET_BNCHAN], 0xff, NBANKS * 2);
-        memset(&radio_mem[OFFSET_BUSE1], 0xff, 2);
-        memset(&radio_mem[OFFSET_BUSE2], 0xff, 2);
+        radio_memset(&radio_mem[OFFSET_BANKS], 0xff, NBANKS * 200);
+        radio_memset(&radio_mem[OFFSET_BNCHAN], 0xff, NBANKS * 2);
+        radio_memset(&radio_mem[OFFSET_BUSE1], 0xff, 2);
+        radio_memset(&radio_mem[OFFSET_BUSE2], 0xff, 2);
+    }
+
+    // Bank listed in a later fragment replaces the previous contents.
+    if (first_row)
+        banks_replaced = 0;
+    if (! (banks_replaced & (1 << (bnum-1)))) {
+        banks_replaced |= 1 << (bnum-1);
+        radio_memset(&radio_mem[OFFSET_BANKS + (bnum-1) * 200], 0xff, 200);
+        radio_memset(&radio_mem[OFFSET_BNCHAN + (bnum-1) * 2], 0xff, 2);
     }
 
     if (*chan_str == '-')
@@ -1616,12 +1743,13 @@ static int parse_banks(int first_row, char *line)
     }
 
     // Set number of channels in the bank.
+    radio_journal(&radio_mem[OFFSET_BNCHAN + (bnum-1)*2], 2);
     *(uint16_t*) &radio_mem[OFFSET_BNCHAN + (bnum-1)*2] = big_endian_16(nchan-1);
 
     // Clear unused flag.
     if (nchan > 0) {
-        memset(&radio_mem[OFFSET_BUSE1], 0, 2);
-        memset(&radio_mem[OFFSET_BUSE2], 0, 2);
+        radio_memset(&radio_mem[OFFSET_BUSE1], 0, 2);
+        radio_memset(&radio_mem[OFFSET_BUSE2], 0, 2);
     }
     return 1;
 }
@@ -1661,12 +1789,83 @@ static int vx2_parse_row(int table_id, int first_row, char *line)
     return 0;
 }
 
+//
+// Find the next used memory channel, starting from index i.
+// Return its index, with name and receive frequency, or NCHAN.
+//
+static int vx2_next_channel(int i, char *name, int *rx_hz)
+{
+    memory_channel_t *ch = (memory_channel_t*) &radio_mem[OFFSET_CHANNELS];
+
+    scan_slots();
+    i = radio_slots_next(&used_slots, i, NCHAN);
+    if (i < NCHAN) {
+        *name = 0;
+        decode_name(ch[i].name, name);
+        *rx_hz = freq_to_hz(ch[i].rxfreq);
+    }
+    return i;
+}
+
+//
+// Rewrite one memory channel from a row of the channel table.
+// Return 0 on failure.
+//
+static int vx2_set_channel(char *line)
+{
+    return parse_channel(ROW_NEXT, line);
+}
+
+//
+// Clear the memory channel, and remove it from all banks.
+// Later channels of the bank list move up by one.
+//
+static void vx2_erase_channel(int i)
+{
+    int b, n;
+
+    clear_channel(i);
+    for (b=0; b<NBANKS; b++) {
+        uint16_t *count = (uint16_t*) &radio_mem[OFFSET_BNCHAN + b*2];
+        uint16_t *data  = (uint16_t*) &radio_mem[OFFSET_BANKS + b*200];
+        int       nchan = big_endian_16(*count);
+
+        if (nchan >= 100)
+            continue;
+        for (n=0; n<=nchan; n++)
+            if (big_endian_16(data[n]) == i)
+                break;
+        if (n > nchan)
+            continue;
+
+        radio_journal(data, 200);
+        memmove(&data[n], &data[n+1], (nchan - n) * 2);
+        data[nchan] = 0xffff;
+        radio_journal(count, 2);
+        *count = nchan ? big_endian_16(nchan - 1) : 0xffff;
+    }
+}
+
+//
+// Stable regions for the fingerprint: the header, virtual jumpers
+// at bytes 10-13, settings and unknown bytes up to the bank lists,
+// without the flags of bank use.  All arrive in the first 400 bytes.
+//
+static const radio_region_t FINGERPRINT[] = {
+    { 0,                 OFFSET_BUSE1 },
+    { OFFSET_BUSE1 + 2,  OFFSET_BUSE2 - OFFSET_BUSE1 - 2 },
+    { OFFSET_BUSE2 + 2,  OFFSET_BNCHAN - OFFSET_BUSE2 - 2 },
+    { 0, 0 },
+};
+
 //
 // Yaesu VX-2R, VX-2E
 //
 radio_device_t radio_vx2 = {
     "Yaesu VX-2",
     19200,
+    NCHAN,
+    FINGERPRINT,
     vx2_download,
     vx2_upload,
     vx2_is_compatible,
@@ -1677,4 +1876,10 @@ radio_device_t radio_vx2 = {
     vx2_parse_parameter,
     vx2_parse_header,
     vx2_parse_row,
+    vx2_query,
+    vx2_wire,
+    vx2_next_channel,
+    print_channel,
+    vx2_set_channel,
+    vx2_erase_channel,
 };